@@ -0,0 +1,166 @@
+#include "Animation.h"
+#include "Scene.h"
+#include "Camera.h"
+#include "Shape.h"
+#include "Stats.h"
+
+using namespace tinyxml2;
+
+Transform parseTransform(const XMLElement *element)
+{
+    Transform transform;
+    for (const XMLElement *child = element->FirstChildElement(); child != nullptr; child = child->NextSiblingElement())
+    {
+        Vector3f v;
+        float angle;
+        const char *str = child->GetText();
+        if (str == nullptr)
+            continue;
+        if (strcmp(child->Name(), "Translation") == 0 && sscanf(str, "%f %f %f", &v.x, &v.y, &v.z) == 3)
+            transform = Transform::translation(v) * transform;
+        else if (strcmp(child->Name(), "Scaling") == 0 && sscanf(str, "%f %f %f", &v.x, &v.y, &v.z) == 3)
+            transform = Transform::scaling(v) * transform;
+        else if (strcmp(child->Name(), "Rotation") == 0 && sscanf(str, "%f %f %f %f", &angle, &v.x, &v.y, &v.z) == 4)
+            transform = Transform::rotation(angle, v) * transform;
+    }
+    return transform;
+}
+
+// Reads the vector in the child element name, if there is one
+static bool parse_vector(const XMLElement *element, const char *name, Vector3f& v)
+{
+    const XMLElement *child = element->FirstChildElement(name);
+    return child != nullptr && child->GetText() != nullptr && sscanf(child->GetText(), "%f %f %f", &v.x, &v.y, &v.z) == 3;
+}
+
+// Index of the shape with the given id, -1 if there is none
+template <typename T>
+static int find_id(const vector<T>& shapes, int id)
+{
+    for (size_t i = 0; i < shapes.size(); i++)
+    {
+        if (shapes[i].id == id)
+            return i;
+    }
+    return -1;
+}
+
+bool Animation::load(const char *path, const Scene& scene)
+{
+    XMLDocument doc;
+    if (doc.LoadFile(path) != XML_SUCCESS || doc.FirstChildElement("Animation") == nullptr)
+    {
+        fprintf(stderr, "could not read the animation %s\n", path);
+        return false;
+    }
+
+    frames.clear();
+    const XMLElement *pFrame = doc.FirstChildElement("Animation")->FirstChildElement("Frame");
+    for (; pFrame != nullptr; pFrame = pFrame->NextSiblingElement("Frame"))
+    {
+        Frame frame;
+        int id;
+
+        for (const XMLElement *e = pFrame->FirstChildElement("Camera"); e != nullptr; e = e->NextSiblingElement("Camera"))
+        {
+            CameraKey key;
+            e->QueryIntAttribute("id", &id);
+            key.camera = -1;
+            for (size_t c = 0; c < scene.cameras.size(); c++)
+            {
+                if (scene.cameras[c]->id == id)
+                    key.camera = c;
+            }
+            if (key.camera == -1)
+            {
+                fprintf(stderr, "%s: frame %d moves camera %d, which is not in the scene\n", path, (int) frames.size(), id);
+                return false;
+            }
+            key.hasPosition = parse_vector(e, "Position", key.position);
+            key.hasGaze = parse_vector(e, "Gaze", key.gaze);
+            key.hasUp = parse_vector(e, "Up", key.up);
+            frame.cameras.push_back(key);
+        }
+
+        for (const XMLElement *e = pFrame->FirstChildElement("Mesh"); e != nullptr; e = e->NextSiblingElement("Mesh"))
+        {
+            ObjectKey key;
+            e->QueryIntAttribute("id", &id);
+            key.object = find_id(scene.meshes, id);
+            if (key.object == -1)
+            {
+                fprintf(stderr, "%s: frame %d moves mesh %d, which is not in the scene\n", path, (int) frames.size(), id);
+                return false;
+            }
+            key.transform = parseTransform(e);
+            frame.meshes.push_back(key);
+        }
+
+        for (const XMLElement *e = pFrame->FirstChildElement("MeshInstance"); e != nullptr; e = e->NextSiblingElement("MeshInstance"))
+        {
+            ObjectKey key;
+            e->QueryIntAttribute("id", &id);
+            key.object = find_id(scene.instances, id);
+            if (key.object == -1)
+            {
+                fprintf(stderr, "%s: frame %d moves mesh instance %d, which is not in the scene\n", path, (int) frames.size(), id);
+                return false;
+            }
+            key.transform = parseTransform(e);
+            frame.instances.push_back(key);
+        }
+
+        frames.push_back(frame);
+    }
+
+    imageNames.clear();
+    for (const Camera* cam : scene.cameras)
+    {
+        imageNames.push_back(cam->imageName);
+        char name[sizeof(cam->imageName)];
+        if (snprintf(name, sizeof(name), "%s_0000", cam->imageName) >= (int) sizeof(name))
+        {
+            fprintf(stderr, "the numbered image names of %s do not fit the camera\n", cam->imageName);
+            return false;
+        }
+    }
+    return true;
+}
+
+int Animation::numFrames() const
+{
+    return frames.size();
+}
+
+/* Only the moved meshes are transformed and refit, the top level BVHs are then
+refit over all shapes. The refit time is added to the build time of the scene. */
+void Animation::apply(Scene& scene, int frame) const
+{
+    const Frame& f = frames[frame];
+
+    for (const CameraKey& key : f.cameras)
+    {
+        Camera* cam = scene.cameras[key.camera];
+        cam->setPose(key.hasPosition ? key.position : cam->pos, key.hasGaze ? key.gaze : cam->gaze, key.hasUp ? key.up : cam->up);
+    }
+
+    for (size_t c = 0; c < scene.cameras.size(); c++)
+    {
+        const string& name = imageNames[c];
+        size_t dot = name.rfind('.');
+        string stem = (dot == string::npos) ? name : name.substr(0, dot);
+        string ext = (dot == string::npos) ? "" : name.substr(dot);
+        snprintf(scene.cameras[c]->imageName, sizeof(scene.cameras[c]->imageName), "%s_%04d%s", stem.c_str(), frame, ext.c_str());
+    }
+
+    if (f.meshes.empty() && f.instances.empty())
+        return;
+
+    double start = currentSeconds();
+    for (const ObjectKey& key : f.meshes)
+        scene.meshes[key.object].setTransform(key.transform);
+    for (const ObjectKey& key : f.instances)
+        scene.instances[key.object].setTransform(key.transform);
+    scene.refitBVH();
+    scene.stats.buildSeconds += currentSeconds() - start;
+}
@@ -0,0 +1,63 @@
+#ifndef _ANIMATION_H_
+#define _ANIMATION_H_
+
+#include <string>
+#include <vector>
+#include "defs.h"
+#include "tinyxml2.h"
+
+using namespace std;
+
+class Scene;
+
+// Composes the <Translation>, <Scaling> and <Rotation> children of an element in the order they are listed
+Transform parseTransform(const tinyxml2::XMLElement *element);
+
+/* Frames of an animation over a base scene, read from an XML file like
+
+	<Animation>
+		<Frame>
+			<Camera id="1"><Position>..</Position><Gaze>..</Gaze><Up>..</Up></Camera>
+			<Mesh id="2"><Rotation>10 0 1 0</Rotation></Mesh>
+			<MeshInstance id="3"><Translation>0 1 0</Translation></MeshInstance>
+		</Frame>
+		...
+	</Animation>
+
+A frame only lists what changes, everything else keeps its state from the frame
+before. Mesh transforms are applied to the mesh as parsed, instance transforms
+replace the one of the instance. Every camera writes frame f to its image name
+with _f (four digits) inserted before the extension. */
+class Animation
+{
+public:
+	bool load(const char *path, const Scene& scene);	// False after printing the problem
+	int numFrames() const;
+	void apply(Scene& scene, int frame) const;	// Moves the scene to the frame, frames must be applied in order
+
+private:
+	typedef struct CameraKey
+	{
+		int camera;		// Index in Scene::cameras
+		bool hasPosition, hasGaze, hasUp;
+		Vector3f position, gaze, up;
+	} CameraKey;
+
+	typedef struct ObjectKey
+	{
+		int object;		// Index in Scene::meshes or Scene::instances
+		Transform transform;
+	} ObjectKey;
+
+	typedef struct Frame
+	{
+		vector<CameraKey> cameras;
+		vector<ObjectKey> meshes;
+		vector<ObjectKey> instances;
+	} Frame;
+
+	vector<Frame> frames;
+	vector<string> imageNames;	// Image names of the cameras in the base scene
+};
+
+#endif
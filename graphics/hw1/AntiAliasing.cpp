@@ -0,0 +1,124 @@
+#include "Scene.h"
+#include "Camera.h"
+#include "Stats.h"
+#include <cmath>
+
+// Radical inverse of i in the given base, the coordinates of the Halton sequence
+static double radical_inverse(int i, int base)
+{
+    double inv_base = 1.0 / base;
+    double f = inv_base;
+    double result = 0;
+    while (i > 0)
+    {
+        result += f * (i % base);
+        i /= base;
+        f *= inv_base;
+    }
+    return result;
+}
+
+// Position of sample i >= 1 inside a pixel. Sample 0 is the pixel center traced by the
+// first pass, the others follow the (2, 3) Halton sequence, so any prefix of the samples
+// covers the pixel evenly.
+static void sample_offset(int i, double& dx, double& dy)
+{
+    dx = radical_inverse(i, 2);
+    dy = radical_inverse(i, 3);
+}
+
+/* Marks the pixels of a tile that differ from one of their eight neighbors by
+more than aaThreshold in any channel. Only reads the one sample image. */
+void Scene::markEdges(const Camera* cam, const ConstImageView& image, vector<unsigned char>& edges, int tile) const
+{
+    int row_begin, row_end, col_begin, col_end;
+    tileBounds(cam, tile, row_begin, row_end, col_begin, col_end);
+
+    for (int i = row_begin; i < row_end; i++)
+    {
+        for (int j = col_begin; j < col_end; j++)
+        {
+            const Color& c = image.at(j, i);
+            bool edge = false;
+            for (int ni = std::max(i - 1, 0); ni <= std::min(i + 1, image.height - 1) && !edge; ni++)
+            {
+                for (int nj = std::max(j - 1, 0); nj <= std::min(j + 1, image.width - 1) && !edge; nj++)
+                {
+                    const Color& n = image.at(nj, ni);
+                    edge = std::abs(c.red - n.red) > aaThreshold || std::abs(c.grn - n.grn) > aaThreshold ||
+                           std::abs(c.blu - n.blu) > aaThreshold;
+                }
+            }
+            edges[i * image.width + j] = edge;
+        }
+    }
+}
+
+/* Supersamples the marked pixels of a tile. The pixel value of the first pass is
+the center sample, further samples are traced in batches of PACKET_SIZE until
+the standard error of the pixel mean drops below aaThreshold or the budget of
+aaMaxSamples is used up. */
+void Scene::refineTile(const Camera* cam, const ImageView& image, const vector<unsigned char>& edges, int tile)
+{
+    int row_begin, row_end, col_begin, col_end;
+    tileBounds(cam, tile, row_begin, row_end, col_begin, col_end);
+
+    Ray rays[PACKET_SIZE];
+    ReturnVal results[PACKET_SIZE];
+
+    for (int i = row_begin; i < row_end; i++)
+    {
+        for (int j = col_begin; j < col_end; j++)
+        {
+            if (!edges[i * image.width + j])
+                continue;
+
+            const Color& center = image.at(j, i);
+            Vector3f sum(center.red, center.grn, center.blu);
+            Vector3f sum_sq = sum.pointwise_multiplication(sum);
+            int n = 1;
+            while (n < aaMaxSamples)
+            {
+                int batch = std::min(PACKET_SIZE, aaMaxSamples - n);
+                for (int lane = 0; lane < PACKET_SIZE; lane++)
+                {
+                    double dx, dy;
+                    sample_offset(n + std::min(lane, batch - 1), dx, dy);
+                    rays[lane] = cam->getRay(j + dx, i + dy);
+                }
+                rayCounters.primaryRays += batch;
+
+                if (packetTracing)
+                {
+                    RayPacket packet(rays);
+                    intersectPacket(packet, rays, results);
+                }
+                else
+                {
+                    for (int lane = 0; lane < batch; lane++)
+                        results[lane] = intersect(rays[lane]);
+                }
+
+                for (int lane = 0; lane < batch; lane++)
+                {
+                    Vector3f color = shade(rays[lane], results[lane], maxRecursionDepth);
+                    color = Vector3f(std::min(color.x, 255.0f), std::min(color.y, 255.0f), std::min(color.z, 255.0f));
+                    sum = sum + color;
+                    sum_sq = sum_sq + color.pointwise_multiplication(color);
+                }
+                n += batch;
+
+                // sample variance per channel, the pixel is done once its mean is accurate enough
+                Vector3f mean = sum / n;
+                Vector3f var = (sum_sq / n - mean.pointwise_multiplication(mean)) * (n / (n - 1.0f));
+                float max_var = std::max(var.x, std::max(var.y, var.z));
+                if (max_var <= aaThreshold * aaThreshold * n)
+                    break;
+            }
+
+            Vector3f color = sum / n;
+            Color result = {(unsigned char) std::round(color.x), (unsigned char) std::round(color.y), (unsigned char) std::round(color.z)};
+            image.at(j, i) = result;
+        }
+    }
+}
@@ -0,0 +1,205 @@
+#include "BVH.h"
+
+#define SAH_BINS 12
+#define MAX_LEAF_SIZE 4
+#define TRAVERSAL_COST 1.0f
+#define INTERSECTION_COST 1.0f
+
+BVH::BVH(void)
+    : mappedNodes(nullptr), mappedPrims(nullptr), numMappedNodes(0), numMappedPrims(0), residentSet(nullptr), firstNodeCluster(0), firstPrimCluster(0)
+{
+}
+
+/* Builds the hierarchy over the given primitive bounds.
+The nodes are appended in depth first order so the tree ends up flattened in one array. */
+void BVH::build(const vector<AABB>& primBounds)
+{
+    nodes.clear();
+    primIndices.clear();
+    mappedNodes = nullptr;
+    residentSet = nullptr;
+
+    int num_prims = primBounds.size();
+    if (num_prims == 0)
+        return;
+
+    vector<Vector3f> centroids(num_prims);
+    primIndices.resize(num_prims);
+    for (int i = 0; i < num_prims; i++)
+    {
+        centroids[i] = primBounds[i].centroid();
+        primIndices[i] = i;
+    }
+
+    nodes.reserve(2 * num_prims);
+    buildRecursive(primBounds, centroids, 0, num_prims);
+}
+
+/* Children are stored after their parent, so a backwards sweep over the nodes
+updates both children before the node that contains them. */
+void BVH::refit(const vector<AABB>& primBounds)
+{
+    if (mappedNodes != nullptr)
+    {
+        nodes.assign(mappedNodes, mappedNodes + numMappedNodes);
+        primIndices.assign(mappedPrims, mappedPrims + numMappedPrims);
+        mappedNodes = nullptr;
+        residentSet = nullptr;
+    }
+
+    for (int n = (int) nodes.size() - 1; n >= 0; n--)
+    {
+        BVHNode& node = nodes[n];
+        AABB bounds;
+        if (node.count > 0)
+        {
+            for (int i = node.offset; i < node.offset + node.count; i++)
+                bounds.expand(primBounds[primIndices[i]]);
+        }
+        else
+        {
+            bounds.expand(nodes[n + 1].bounds);
+            bounds.expand(nodes[node.offset].bounds);
+        }
+        node.bounds = bounds;
+    }
+}
+
+void BVH::map(const BVHNode* nodes, int numNodes, const int* primIndices, int numPrims, ResidentSet* residentSet, int firstNodeCluster, int firstPrimCluster)
+{
+    this->nodes.clear();
+    this->primIndices.clear();
+    mappedNodes = (numNodes > 0) ? nodes : nullptr;
+    mappedPrims = primIndices;
+    numMappedNodes = numNodes;
+    numMappedPrims = numPrims;
+    this->residentSet = residentSet;
+    this->firstNodeCluster = firstNodeCluster;
+    this->firstPrimCluster = firstPrimCluster;
+}
+
+bool BVH::empty() const
+{
+    return nodes.empty() && mappedNodes == nullptr;
+}
+
+AABB BVH::bounds() const
+{
+    if (empty())
+        return AABB();
+    touchNode(0);
+    return nodeData()[0].bounds;
+}
+
+static float axis_value(const Vector3f& v, int axis)
+{
+    return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+}
+
+// Creates the node for primIndices[first, first + count) and returns its index
+int BVH::buildRecursive(const vector<AABB>& primBounds, const vector<Vector3f>& centroids, int first, int count)
+{
+    int node_index = nodes.size();
+    nodes.push_back(BVHNode());
+
+    AABB bounds, centroid_bounds;
+    for (int i = first; i < first + count; i++)
+    {
+        bounds.expand(primBounds[primIndices[i]]);
+        centroid_bounds.expand(centroids[primIndices[i]]);
+    }
+    nodes[node_index].bounds = bounds;
+    nodes[node_index].offset = first;
+    nodes[node_index].count = count;
+
+    if (count <= 1)
+        return node_index;
+
+    // binned surface area heuristic, every axis is tried
+    float leaf_cost = INTERSECTION_COST * count;
+    float best_cost = std::numeric_limits<float>::infinity();
+    int best_axis = -1;
+    int best_split = 0;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float cmin = axis_value(centroid_bounds.min, axis);
+        float cmax = axis_value(centroid_bounds.max, axis);
+        if (cmax - cmin <= 0)
+            continue;
+
+        AABB bin_bounds[SAH_BINS];
+        int bin_counts[SAH_BINS] = {0};
+        float scale = SAH_BINS / (cmax - cmin);
+
+        for (int i = first; i < first + count; i++)
+        {
+            int bin = (int) ((axis_value(centroids[primIndices[i]], axis) - cmin) * scale);
+            bin = std::min(bin, SAH_BINS - 1);
+            bin_counts[bin]++;
+            bin_bounds[bin].expand(primBounds[primIndices[i]]);
+        }
+
+        // sweep from the right to get the cost of every right side
+        float right_area[SAH_BINS];
+        int right_count[SAH_BINS];
+        AABB acc;
+        int acc_count = 0;
+        for (int b = SAH_BINS - 1; b > 0; b--)
+        {
+            acc.expand(bin_bounds[b]);
+            acc_count += bin_counts[b];
+            right_area[b] = acc.surfaceArea();
+            right_count[b] = acc_count;
+        }
+
+        acc = AABB();
+        acc_count = 0;
+        for (int b = 0; b < SAH_BINS - 1; b++)
+        {
+            acc.expand(bin_bounds[b]);
+            acc_count += bin_counts[b];
+            if (acc_count == 0 || right_count[b + 1] == 0)
+                continue;
+            float cost = acc.surfaceArea() * acc_count + right_area[b + 1] * right_count[b + 1];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    float parent_area = bounds.surfaceArea();
+    if (best_axis != -1 && parent_area > 0)
+        best_cost = TRAVERSAL_COST + INTERSECTION_COST * best_cost / parent_area;
+
+    // small nodes stay leaves unless splitting is cheaper
+    if (count <= MAX_LEAF_SIZE && (best_axis == -1 || best_cost >= leaf_cost))
+        return node_index;
+
+    int mid;
+    if (best_axis != -1)
+    {
+        float cmin = axis_value(centroid_bounds.min, best_axis);
+        float scale = SAH_BINS / (axis_value(centroid_bounds.max, best_axis) - cmin);
+        int* split = std::partition(&primIndices[first], &primIndices[first] + count, [&](int p) {
+            int bin = (int) ((axis_value(centroids[p], best_axis) - cmin) * scale);
+            return std::min(bin, SAH_BINS - 1) <= best_split;
+        });
+        mid = split - &primIndices[0];
+    }
+    else
+    {
+        // all centroids coincide, just cut the list in half
+        mid = first + count / 2;
+    }
+
+    nodes[node_index].count = 0;
+    buildRecursive(primBounds, centroids, first, mid - first);
+    int right = buildRecursive(primBounds, centroids, mid, first + count - mid);
+    nodes[node_index].offset = right;
+
+    return node_index;
+}
@@ -0,0 +1,438 @@
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include <vector>
+#include <algorithm>
+#include "Ray.h"
+#include "RayPacket.h"
+#include "ResidentSet.h"
+#include "defs.h"
+
+using namespace std;
+
+// Axis aligned bounding box
+typedef struct AABB
+{
+	Vector3f min;
+	Vector3f max;
+
+	AABB()
+		: min(numeric_limits<float>::infinity(), numeric_limits<float>::infinity(), numeric_limits<float>::infinity()),
+		  max(-numeric_limits<float>::infinity(), -numeric_limits<float>::infinity(), -numeric_limits<float>::infinity())
+	{}
+
+	void expand(const Vector3f& p)
+	{
+		min = Vector3f(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+		max = Vector3f(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+	}
+
+	void expand(const AABB& box)
+	{
+		expand(box.min);
+		expand(box.max);
+	}
+
+	// grows the box a little so that flat primitives and hits that are
+	// accepted with intersection epsilons still fall inside it
+	void pad()
+	{
+		Vector3f d = max - min;
+		float p = 1e-4f * std::max(d.x, std::max(d.y, d.z)) + 1e-6f;
+		min = min - Vector3f(p, p, p);
+		max = max + Vector3f(p, p, p);
+	}
+
+	Vector3f centroid() const
+	{
+		return (min + max) * 0.5f;
+	}
+
+	float surfaceArea() const
+	{
+		Vector3f d = max - min;
+		if (d.x < 0 || d.y < 0 || d.z < 0)
+			return 0;
+		return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	bool contains(const Vector3f& p) const
+	{
+		return p.x >= min.x && p.x <= max.x && p.y >= min.y && p.y <= max.y && p.z >= min.z && p.z <= max.z;
+	}
+
+	// slab test, returns the entry distance or infinity on a miss
+	float intersect(const Ray& ray, const Vector3f& invDir, float tmax) const
+	{
+		float tx0 = (min.x - ray.origin.x) * invDir.x;
+		float tx1 = (max.x - ray.origin.x) * invDir.x;
+		float ty0 = (min.y - ray.origin.y) * invDir.y;
+		float ty1 = (max.y - ray.origin.y) * invDir.y;
+		float tz0 = (min.z - ray.origin.z) * invDir.z;
+		float tz1 = (max.z - ray.origin.z) * invDir.z;
+
+		float tNear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::min(tz0, tz1));
+		float tFar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+
+		if (tNear > tFar || tFar < 0 || tNear > tmax)
+			return numeric_limits<float>::infinity();
+		return tNear;
+	}
+
+} AABB;
+
+// Node of the flattened hierarchy. Nodes are stored in depth first order,
+// so the left child of an interior node is always the next node in the array.
+typedef struct BVHNode
+{
+	AABB bounds;
+	int offset;	// index of the right child for interior nodes, first primitive for leaves
+	int count;	// number of primitives, 0 for interior nodes
+} BVHNode;
+
+// Bounding volume hierarchy over an arbitrary list of primitives.
+// Primitives are referred to by their index in the list given to build().
+// The arrays are either in memory or read in place from a mapped scene cache.
+class BVH
+{
+public:
+	vector<BVHNode> nodes;		// Flattened nodes, nodes[0] is the root. Empty when mapped
+	vector<int> primIndices;	// Primitive indices referenced by the leaves. Empty when mapped
+
+	BVH();
+
+	void build(const vector<AABB>& primBounds);	// Builds the hierarchy using the surface area heuristic
+	void refit(const vector<AABB>& primBounds);	// Recomputes the node bounds for moved primitives, the tree stays the same.
+												// A mapped hierarchy is copied into memory first.
+
+	// Reads the arrays from a mapping instead, reporting the clusters read to residentSet
+	void map(const BVHNode* nodes, int numNodes, const int* primIndices, int numPrims, ResidentSet* residentSet, int firstNodeCluster, int firstPrimCluster);
+
+	bool empty() const;
+	AABB bounds() const;	// Bounds of the root, empty when there are no primitives
+
+	// The traversals count the primitives they hand to the callback once per leaf,
+	// the callers add the count to the ray counters once per traversal.
+
+	// Visits the leaves hit by the ray, nearer child first. intersectPrim(index, tmax)
+	// must test the primitive and shrink tmax on a closer hit. Returns the number of
+	// primitives tested.
+	template <typename F>
+	int traverse(const Ray& ray, float& tmax, F intersectPrim) const;
+
+	// Returns as soon as occludedPrim(index, tmax) reports a hit, children are visited in any order.
+	// The number of primitives tested is added to tests.
+	template <typename F>
+	bool occluded(const Ray& ray, float tmax, F occludedPrim, int& tests) const;
+
+	// Packet version of traverse. A node is visited when any ray of the packet hits it.
+	// intersectPrim(index, tmax) must test the primitive against all rays and shrink
+	// tmax[lane] for the rays that found a closer hit.
+	template <typename F>
+	int traversePacket(const RayPacket& packet, float tmax[PACKET_SIZE], F intersectPrim) const;
+
+	// Calls visitPrim(index) for every primitive in a leaf whose bounds contain p
+	template <typename F>
+	void query(const Vector3f& p, F visitPrim) const;
+
+private:
+	const BVHNode* mappedNodes;	// Null when the arrays are in memory
+	const int* mappedPrims;
+	int numMappedNodes;
+	int numMappedPrims;
+	ResidentSet* residentSet;
+	int firstNodeCluster;
+	int firstPrimCluster;
+
+	const BVHNode* nodeData() const
+	{
+		return (mappedNodes != nullptr) ? mappedNodes : nodes.data();
+	}
+
+	const int* primData() const
+	{
+		return (mappedNodes != nullptr) ? mappedPrims : primIndices.data();
+	}
+
+	void touchNode(int n) const
+	{
+		if (residentSet != nullptr)
+			residentSet->touch(firstNodeCluster + (int) ((size_t) n * sizeof(BVHNode) / CLUSTER_BYTES));
+	}
+
+	// A leaf refers to a few consecutive indices, which span at most two clusters
+	void touchLeaf(const BVHNode& leaf) const
+	{
+		if (residentSet != nullptr)
+		{
+			residentSet->touch(firstPrimCluster + (int) ((size_t) leaf.offset * sizeof(int) / CLUSTER_BYTES));
+			residentSet->touch(firstPrimCluster + (int) ((size_t) (leaf.offset + leaf.count - 1) * sizeof(int) / CLUSTER_BYTES));
+		}
+	}
+
+	int buildRecursive(const vector<AABB>& primBounds, const vector<Vector3f>& centroids, int first, int count);
+};
+
+template <typename F>
+int BVH::traverse(const Ray& ray, float& tmax, F intersectPrim) const
+{
+	if (empty())
+		return 0;
+	const BVHNode* nodeArray = nodeData();
+	const int* primArray = primData();
+
+	const float infty = numeric_limits<float>::infinity();
+	Vector3f invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+	touchNode(0);
+	if (nodeArray[0].bounds.intersect(ray, invDir, tmax) == infty)
+		return 0;
+
+	int tests = 0;
+	int stack[64];
+	float stackT[64];
+	int stackSize = 0;
+	int current = 0;
+
+	while (true)
+	{
+		const BVHNode& node = nodeArray[current];
+
+		if (node.count > 0)
+		{
+			touchLeaf(node);
+			tests += node.count;
+			for (int i = node.offset; i < node.offset + node.count; i++)
+			{
+				intersectPrim(primArray[i], tmax);
+			}
+		}
+		else
+		{
+			int left = current + 1;
+			int right = node.offset;
+			touchNode(left);
+			touchNode(right);
+			float tLeft = nodeArray[left].bounds.intersect(ray, invDir, tmax);
+			float tRight = nodeArray[right].bounds.intersect(ray, invDir, tmax);
+
+			if (tLeft > tRight)
+			{
+				std::swap(tLeft, tRight);
+				std::swap(left, right);
+			}
+
+			if (tLeft != infty)
+			{
+				if (tRight != infty)
+				{
+					stack[stackSize] = right;
+					stackT[stackSize++] = tRight;
+				}
+				current = left;
+				continue;
+			}
+		}
+
+		// pop the next node that is still closer than the closest hit
+		bool found = false;
+		while (stackSize > 0)
+		{
+			stackSize--;
+			if (stackT[stackSize] <= tmax)
+			{
+				current = stack[stackSize];
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			break;
+	}
+
+	return tests;
+}
+
+template <typename F>
+bool BVH::occluded(const Ray& ray, float tmax, F occludedPrim, int& tests) const
+{
+	if (empty())
+		return false;
+	const BVHNode* nodeArray = nodeData();
+	const int* primArray = primData();
+
+	const float infty = numeric_limits<float>::infinity();
+	Vector3f invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+	int stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		int current = stack[--stackSize];
+		touchNode(current);
+		const BVHNode& node = nodeArray[current];
+
+		if (node.bounds.intersect(ray, invDir, tmax) == infty)
+			continue;
+
+		if (node.count > 0)
+		{
+			touchLeaf(node);
+			for (int i = node.offset; i < node.offset + node.count; i++)
+			{
+				if (occludedPrim(primArray[i], tmax))
+				{
+					tests += i - node.offset + 1;
+					return true;
+				}
+			}
+			tests += node.count;
+		}
+		else
+		{
+			stack[stackSize++] = node.offset;
+			stack[stackSize++] = current + 1;
+		}
+	}
+
+	return false;
+}
+
+template <typename F>
+void BVH::query(const Vector3f& p, F visitPrim) const
+{
+	if (empty())
+		return;
+	const BVHNode* nodeArray = nodeData();
+	const int* primArray = primData();
+
+	int stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		int current = stack[--stackSize];
+		touchNode(current);
+		const BVHNode& node = nodeArray[current];
+
+		if (!node.bounds.contains(p))
+			continue;
+
+		if (node.count > 0)
+		{
+			touchLeaf(node);
+			for (int i = node.offset; i < node.offset + node.count; i++)
+				visitPrim(primArray[i]);
+		}
+		else
+		{
+			stack[stackSize++] = node.offset;
+			stack[stackSize++] = current + 1;
+		}
+	}
+}
+
+// Slab test of a box against all rays of a packet. Returns the mask of rays that
+// hit the box before their tmax and the smallest entry distance among them.
+inline int intersectPacket(const AABB& box, const vfloat4 origin[3], const vfloat4 invDir[3], vfloat4 tmax, float& tNearMin)
+{
+	vfloat4 tx0 = (vfloat4(box.min.x) - origin[0]) * invDir[0];
+	vfloat4 tx1 = (vfloat4(box.max.x) - origin[0]) * invDir[0];
+	vfloat4 ty0 = (vfloat4(box.min.y) - origin[1]) * invDir[1];
+	vfloat4 ty1 = (vfloat4(box.max.y) - origin[1]) * invDir[1];
+	vfloat4 tz0 = (vfloat4(box.min.z) - origin[2]) * invDir[2];
+	vfloat4 tz1 = (vfloat4(box.max.z) - origin[2]) * invDir[2];
+
+	vfloat4 tNear = vmax(vmax(vmin(tx0, tx1), vmin(ty0, ty1)), vmin(tz0, tz1));
+	vfloat4 tFar = vmin(vmin(vmax(tx0, tx1), vmax(ty0, ty1)), vmax(tz0, tz1));
+
+	// written as negated rejections so that NaN lanes are kept, like the scalar test
+	vbool4 hit = not_greater(tNear, tFar) & not_less(tFar, vfloat4(0.0f)) & not_greater(tNear, tmax);
+	int mask = hit.mask();
+
+	if (mask != 0)
+	{
+		alignas(16) float t[PACKET_SIZE];
+		tNear.store(t);
+		tNearMin = numeric_limits<float>::infinity();
+		for (int i = 0; i < PACKET_SIZE; i++)
+		{
+			if ((mask & (1 << i)) && t[i] < tNearMin)
+				tNearMin = t[i];
+		}
+	}
+	return mask;
+}
+
+template <typename F>
+int BVH::traversePacket(const RayPacket& packet, float tmax[PACKET_SIZE], F intersectPrim) const
+{
+	if (empty())
+		return 0;
+	const BVHNode* nodeArray = nodeData();
+	const int* primArray = primData();
+
+	vfloat4 origin[3] = {vfloat4::load(packet.ox), vfloat4::load(packet.oy), vfloat4::load(packet.oz)};
+	vfloat4 invDir[3] = {vfloat4::load(packet.invx), vfloat4::load(packet.invy), vfloat4::load(packet.invz)};
+	alignas(16) float tm[PACKET_SIZE];
+	for (int i = 0; i < PACKET_SIZE; i++)
+		tm[i] = tmax[i];
+
+	float tRoot;
+	touchNode(0);
+	if (intersectPacket(nodeArray[0].bounds, origin, invDir, vfloat4::load(tm), tRoot) == 0)
+		return 0;
+
+	int tests = 0;
+	int stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		int current = stack[--stackSize];
+		const BVHNode& node = nodeArray[current];
+
+		if (node.count > 0)
+		{
+			touchLeaf(node);
+			tests += node.count;
+			for (int i = node.offset; i < node.offset + node.count; i++)
+			{
+				intersectPrim(primArray[i], tm);
+			}
+			continue;
+		}
+
+		int left = current + 1;
+		int right = node.offset;
+		touchNode(left);
+		touchNode(right);
+		float tLeft, tRight;
+		vfloat4 tmv = vfloat4::load(tm);
+		int leftMask = intersectPacket(nodeArray[left].bounds, origin, invDir, tmv, tLeft);
+		int rightMask = intersectPacket(nodeArray[right].bounds, origin, invDir, tmv, tRight);
+
+		// push the farther child first so the nearer one is popped next
+		if (leftMask && rightMask)
+		{
+			if (tLeft > tRight)
+				std::swap(left, right);
+			stack[stackSize++] = right;
+			stack[stackSize++] = left;
+		}
+		else if (leftMask)
+			stack[stackSize++] = left;
+		else if (rightMask)
+			stack[stackSize++] = right;
+	}
+
+	for (int i = 0; i < PACKET_SIZE; i++)
+		tmax[i] = tm[i];
+	return tests;
+}
+
+#endif
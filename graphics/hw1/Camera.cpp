@@ -1,4 +1,5 @@
 #include "Camera.h"
+#include "VectorBatch.h"
 
 Camera::Camera(int id,                      // Id of the camera
                const char* imageName,       // Name of the output PPM file 
@@ -23,6 +24,8 @@ Camera::Camera(int id,                      // Id of the camera
       this->imgPlane.distance = imgPlane.distance;
       this->imgPlane.nx = imgPlane.nx;
       this->imgPlane.ny = imgPlane.ny;
+      Vector3f m = pos + gaze * imgPlane.distance;
+      this->q = m + u * imgPlane.left + up * imgPlane.top;
 }
 
 /* Takes coordinate of an image pixel as row and col, and
@@ -31,17 +34,57 @@ Camera::Camera(int id,                      // Id of the camera
 
 // col : j, row : i
 Ray Camera::getPrimaryRay(int col, int row) const
+{
+     return getRay(col + 0.5, row + 0.5);
+}
+
+void Camera::setPose(const Vector3f& pos, const Vector3f& gaze, const Vector3f& up)
+{
+     this->pos = pos;
+     this->gaze = gaze;
+     this->up = up;
+     this->w = gaze * (-1);
+     this->u = up.cross_product(w);
+     Vector3f m = pos + gaze * imgPlane.distance;
+     this->q = m + u * imgPlane.left + up * imgPlane.top;
+}
+
+float Camera::pixelU(double x) const
+{
+     return x * (imgPlane.right - imgPlane.left) / imgPlane.nx;
+}
+
+float Camera::pixelV(double y) const
+{
+     return y * (imgPlane.top - imgPlane.bottom) / imgPlane.ny;
+}
+
+// Used for the sub-pixel samples of anti-aliasing
+Ray Camera::getRay(double x, double y) const
 {
      Ray result;
      result.origin = pos;
-     float s_u = (col + 0.5) * (imgPlane.right - imgPlane.left) / imgPlane.nx;
-     float s_v = (row + 0.5) * (imgPlane.top - imgPlane.bottom) / imgPlane.ny;
-     Vector3f m = pos + gaze * imgPlane.distance;
-     Vector3f q = m + u * imgPlane.left + up * imgPlane.top;
-     Vector3f s = q + u * s_u - up * s_v;
+     Vector3f s = q + u * pixelU(x) - up * pixelV(y);
      result.direction = s - pos;
      return result;
+}
 
-
+void Camera::getPrimaryRays(int row, int col, int count, Ray* rays) const
+{
+     vvector3 q4(q), u4(u), up4(up), pos4(pos);
+     vfloat4 s_v(pixelV(row + 0.5));
+     int k = 0;
+     for (; k + 4 <= count; k += 4)
+     {
+          alignas(16) float s_u[4];
+          for (int lane = 0; lane < 4; lane++)
+               s_u[lane] = pixelU(col + k + lane + 0.5);
+          Vector3f directions[4];
+          (q4 + u4 * vfloat4::load(s_u) - up4 * s_v - pos4).store(directions);
+          for (int lane = 0; lane < 4; lane++)
+               rays[k + lane] = Ray(pos, directions[lane]);
+     }
+     for (; k < count; k++)
+          rays[k] = getPrimaryRay(col + k, row);
 }
 
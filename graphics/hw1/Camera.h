@@ -34,7 +34,22 @@ public:
     // Computes the primary ray through pixel (row, col)
 	Ray getPrimaryRay(int row, int col) const;
 
+    // Computes the ray through the image plane point (x, y) given in pixel units,
+    // the center of pixel (row, col) is (col + 0.5, row + 0.5)
+	Ray getRay(double x, double y) const;
+
+    // Computes the primary rays of count pixels of a row from (row, col) on,
+    // four at a time in SIMD lanes. The rays equal the ones of getPrimaryRay
+    void getPrimaryRays(int row, int col, int count, Ray* rays) const;
+
+    // Moves the camera, the image plane stays the same
+    void setPose(const Vector3f& pos, const Vector3f& gaze, const Vector3f& up);
+
 private:
+    friend class SceneCache;
+    friend class GBuffer;
+    friend class Animation;
+
     //
 	// You can add member functions and variables here
     //
@@ -43,6 +58,10 @@ private:
     Vector3f up;          // Camera up direction : v
     Vector3f u;           // u
     Vector3f w;
+    Vector3f q;           // Top left corner of the image plane, set with the pose
+
+    float pixelU(double x) const;   // Offsets of the image plane point (x, y) from q
+    float pixelV(double y) const;
 };
 
 #endif
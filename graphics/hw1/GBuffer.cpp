@@ -0,0 +1,180 @@
+#include "GBuffer.h"
+#include "Scene.h"
+#include "Camera.h"
+#include "Shape.h"
+
+#include <unistd.h>
+
+#define GBUFFER_MAGIC 0x42475452	// "RTGB"
+#define GBUFFER_VERSION 2
+
+typedef struct GBufferHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    int width;
+    int height;
+    unsigned long long geometryHash;
+} GBufferHeader;
+
+// FNV-1a hash that can be fed in pieces
+typedef struct Hasher
+{
+    unsigned long long hash;
+
+    Hasher() : hash(14695981039346656037ull) {}
+
+    void add(const void *data, size_t size)
+    {
+        const unsigned char *bytes = (const unsigned char *) data;
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+    }
+
+    template <typename T>
+    void add(const T& value)
+    {
+        add(&value, sizeof(T));
+    }
+
+    template <typename T>
+    void addArray(const vector<T>& values)
+    {
+        add(values.size());
+        add(values.data(), values.size() * sizeof(T));
+    }
+
+    // field by field, the padding of TriangleData is not initialized
+    void addTriangle(const TriangleData& triangle)
+    {
+        add(triangle.vertex1);
+        add(triangle.edge1);
+        add(triangle.edge2);
+        add(triangle.normal);
+        add(triangle.matIndex);
+    }
+} Hasher;
+
+// Everything that decides which surface a primary ray hits: the shapes with their
+// material assignment, the intersection epsilon and the camera
+unsigned long long GBuffer::geometryHash(const Scene& scene, const Camera& cam)
+{
+    Hasher hasher;
+    hasher.add(scene.intTestEps);
+    hasher.addArray(scene.vertices);
+
+    for (const Sphere& sphere : scene.spheres)
+    {
+        hasher.add(sphere.id);
+        hasher.add(sphere.matIndex);
+        hasher.add(sphere.cIndex);
+        hasher.add(sphere.R);
+    }
+    for (const Triangle& triangle : scene.triangles)
+    {
+        hasher.add(triangle.id);
+        hasher.addTriangle(triangle.data);
+    }
+    for (const Mesh& mesh : scene.meshes)
+    {
+        hasher.add(mesh.id);
+        hasher.add((size_t) mesh.numFaces());
+        for (int i = 0; i < mesh.numFaces(); i++)
+            hasher.addTriangle(mesh.faceData()[i]);
+    }
+    for (const MeshInstance& instance : scene.instances)
+    {
+        hasher.add(instance.id);
+        hasher.add(instance.matIndex);
+        hasher.add(instance.meshIndex);
+        hasher.add(instance.objectToWorld);
+    }
+
+    hasher.add(cam.pos);
+    hasher.add(cam.gaze);
+    hasher.add(cam.up);
+    hasher.add(cam.imgPlane);
+    return hasher.hash;
+}
+
+// Size of the shape array of an ObjectType, 0 for anything else
+static int num_objects(const Scene& scene, int objectType)
+{
+    switch (objectType)
+    {
+    case OBJECT_SPHERE:
+        return scene.spheres.size();
+    case OBJECT_TRIANGLE:
+        return scene.triangles.size();
+    case OBJECT_MESH:
+        return scene.meshes.size();
+    case OBJECT_INSTANCE:
+        return scene.instances.size();
+    default:
+        return 0;
+    }
+}
+
+string GBuffer::path(const Camera& cam)
+{
+    return string(cam.imageName) + ".gbuf";
+}
+
+bool GBuffer::load(const Scene& scene, const Camera& cam, vector<GBufferPixel>& pixels)
+{
+    FILE *input = fopen(path(cam).c_str(), "rb");
+    if (input == nullptr)
+        return false;
+
+    GBufferHeader header;
+    bool valid = fread(&header, sizeof(header), 1, input) == 1 &&
+                 header.magic == GBUFFER_MAGIC && header.version == GBUFFER_VERSION &&
+                 header.width == cam.imgPlane.nx && header.height == cam.imgPlane.ny &&
+                 header.geometryHash == geometryHash(scene, cam);
+    if (valid)
+    {
+        pixels.resize((size_t) header.width * header.height);
+        valid = fread(pixels.data(), sizeof(GBufferPixel), pixels.size(), input) == pixels.size();
+    }
+    fclose(input);
+
+    // material and object indices are checked here, shading trusts them
+    for (size_t i = 0; valid && i < pixels.size(); i++)
+    {
+        const GBufferPixel& pixel = pixels[i];
+        valid = pixel.material >= 0 && pixel.material <= (int) scene.materials.size() &&
+                pixel.object < num_objects(scene, pixel.objectType) && (pixel.object >= 0 || pixel.material == 0);
+    }
+    if (!valid)
+        pixels.clear();
+    return valid;
+}
+
+bool GBuffer::save(const Scene& scene, const Camera& cam, const vector<GBufferPixel>& pixels)
+{
+    GBufferHeader header;
+    header.magic = GBUFFER_MAGIC;
+    header.version = GBUFFER_VERSION;
+    header.width = cam.imgPlane.nx;
+    header.height = cam.imgPlane.ny;
+    header.geometryHash = geometryHash(scene, cam);
+
+    // write to a temporary file and rename it, so readers never see a partial buffer
+    string target = path(cam);
+    string tmpPath = target + ".tmp" + to_string(getpid());
+    FILE *output = fopen(tmpPath.c_str(), "wb");
+    if (output == nullptr)
+        return false;
+    bool written = fwrite(&header, sizeof(header), 1, output) == 1 &&
+                   fwrite(pixels.data(), sizeof(GBufferPixel), pixels.size(), output) == pixels.size();
+    written = (fclose(output) == 0) && written;
+    if (!written || rename(tmpPath.c_str(), target.c_str()) != 0)
+    {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef _GBUFFER_H_
+#define _GBUFFER_H_
+
+#include <string>
+#include <vector>
+#include "defs.h"
+
+using namespace std;
+
+class Scene;
+class Camera;
+
+// Primary hit of one pixel
+typedef struct GBufferPixel
+{
+	Vector3f position;	// Intersection point
+	Vector3f normal;	// Surface normal at the intersection point
+	float t;			// Ray parameter of the hit
+	int material;		// Material index, 0 where the primary ray hit nothing
+	int objectType;		// ObjectType of the hit object, 0 where nothing was hit
+	int object;			// Index of the hit object in the array of its type, -1 where nothing was hit
+	int prim;			// Face index inside the mesh for mesh and instance hits, 0 otherwise
+} GBufferPixel;
+
+// Per camera buffer of the primary hits, written next to the output image as
+// <image>.gbuf. Relighting shades the stored hits instead of tracing primary rays,
+// so the buffer is only valid while the geometry and the camera stay the same.
+// Lights and material coefficients may change freely.
+class GBuffer
+{
+public:
+	static bool load(const Scene& scene, const Camera& cam, vector<GBufferPixel>& pixels);	// False if there is no valid buffer for the camera
+	static bool save(const Scene& scene, const Camera& cam, const vector<GBufferPixel>& pixels);
+
+private:
+	static unsigned long long geometryHash(const Scene& scene, const Camera& cam);
+	static string path(const Camera& cam);
+};
+
+#endif
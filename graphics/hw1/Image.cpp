@@ -1,14 +1,43 @@
 #include "Image.h"
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#define IMAGE_ALIGNMENT 64
 
 Image::Image(int width, int height)
     : width(width), height(height)
 {
-    data = new Color* [height];
+    // 64 pixels of 3 bytes are exactly 3 cache lines, so every row starts on a line
+    stride = (width + 63) / 64 * 64;
+    size_t bytes = (size_t) stride * height * sizeof(Color);
+    data = (Color*) aligned_alloc(IMAGE_ALIGNMENT, (bytes > 0) ? bytes : IMAGE_ALIGNMENT);
+    if (data == nullptr)
+        throw std::bad_alloc();     // fails like an image allocated with new would
+    memset(data, 0, bytes);
+}
 
-    for (int y = 0; y < height; ++y)
-    {
-        data[y] = new Color [width];
-    }
+Image::~Image()
+{
+    free(data);
+}
+
+Image::Image(Image&& other)
+    : width(other.width), height(other.height), stride(other.stride), data(other.data)
+{
+    other.data = nullptr;
+}
+
+ImageView Image::view()
+{
+    ImageView result = {data, width, height, stride};
+    return result;
+}
+
+ConstImageView Image::view() const
+{
+    ConstImageView result = {data, width, height, stride};
+    return result;
 }
 
 //
@@ -16,31 +45,215 @@ Image::Image(int width, int height)
 //
 void Image::setPixelValue(int col, int row, const Color& color)
 {
-    data[row][col] = color;
+    data[(size_t) row * stride + col] = color;
 }
 
-/* Takes the image name as a file and saves it as a ppm file. */
-void Image::saveImage(const char *imageName) const
+/* Takes the image name as a file and saves it in the given format. 
+The whole file is encoded into one buffer and written with a single call. */
+bool Image::saveImage(const char *imageName, ImageFormat format) const
 {
+    if (format == IMAGE_FORMAT_AUTO)
+    {
+        size_t len = strlen(imageName);
+        format = (len >= 4 && strcmp(imageName + len - 4, ".png") == 0) ? IMAGE_FORMAT_PNG : IMAGE_FORMAT_P3;
+    }
+
+    vector<unsigned char> buffer;
+    if (format == IMAGE_FORMAT_P6)
+        encodeP6(buffer);
+    else if (format == IMAGE_FORMAT_PNG)
+        encodePNG(buffer);
+    else
+        encodeP3(buffer);
+
 	FILE *output;
 
-	output = fopen(imageName, "w");
-	fprintf(output, "P3\n");
-	fprintf(output, "%d %d\n", width, height);
-	fprintf(output, "255\n");
+	output = fopen(imageName, "wb");
+    if (output == nullptr)
+        return false;
+    bool written = fwrite(buffer.data(), 1, buffer.size(), output) == buffer.size();
+    return (fclose(output) == 0) && written;
+}
+
+// The automatic format follows the name, so only an explicit one can disagree with it
+bool Image::matchExtension(char *imageName, size_t size, ImageFormat format)
+{
+    if (format == IMAGE_FORMAT_AUTO)
+        return false;
+    const char *ext = (format == IMAGE_FORMAT_PNG) ? ".png" : ".ppm";
+
+    // the extension is what follows the last dot of the file name, if it has one
+    size_t len = strlen(imageName);
+    const char *dot = strrchr(imageName, '.');
+    const char *slash = strrchr(imageName, '/');
+    size_t stem = (dot != nullptr && (slash == nullptr || dot > slash)) ? dot - imageName : len;
+    if (strcmp(imageName + stem, ext) == 0 || stem + strlen(ext) >= size)
+        return false;
+    strcpy(imageName + stem, ext);
+    return true;
+}
 
+static void append_string(vector<unsigned char>& buffer, const char *str)
+{
+    buffer.insert(buffer.end(), str, str + strlen(str));
+}
+
+static void append_header(vector<unsigned char>& buffer, const char *magic, int width, int height)
+{
+    char header[64];
+    snprintf(header, sizeof(header), "%s\n%d %d\n255\n", magic, width, height);
+    append_string(buffer, header);
+}
+
+// ASCII PPM, byte for byte what the original fprintf based writer produced
+void Image::encodeP3(vector<unsigned char>& buffer) const
+{
+    buffer.reserve(32 + (size_t) width * height * 12 + height);
+    append_header(buffer, "P3", width, height);
+
+	ConstImageView pixels = view();
 	for(int y = 0 ; y < height; y++)
 	{
+		const Color* row = pixels.row(y);
 		for(int x = 0 ; x < width; x++)
         {
             for (int c = 0; c < 3; ++c)
             {
-                fprintf(output, "%d ", data[y][x].channel[c]);
+                unsigned char v = row[x].channel[c];
+                if (v >= 100)
+                    buffer.push_back('0' + v / 100);
+                if (v >= 10)
+                    buffer.push_back('0' + (v / 10) % 10);
+                buffer.push_back('0' + v % 10);
+                buffer.push_back(' ');
             }
         }
 
-		fprintf(output, "\n");
+		buffer.push_back('\n');
 	}
+}
+
+// Binary PPM
+void Image::encodeP6(vector<unsigned char>& buffer) const
+{
+    append_header(buffer, "P6", width, height);
+    size_t header_size = buffer.size();
+    buffer.resize(header_size + (size_t) width * height * 3);
+
+    unsigned char *out = &buffer[header_size];
+    ConstImageView pixels = view();
+	for(int y = 0 ; y < height; y++)
+	{
+        memcpy(out, pixels.row(y), (size_t) width * 3);
+        out += (size_t) width * 3;
+    }
+}
+
+typedef struct CrcTable
+{
+    unsigned int entries[256];
+
+    CrcTable()
+    {
+        for (unsigned int n = 0; n < 256; n++)
+        {
+            unsigned int c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            entries[n] = c;
+        }
+    }
+} CrcTable;
+
+static unsigned int crc32_update(unsigned int crc, const unsigned char *bytes, size_t len)
+{
+    static const CrcTable table;    // initialized once, thread safe
+
+    for (size_t i = 0; i < len; i++)
+        crc = table.entries[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static void append_u32(vector<unsigned char>& buffer, unsigned int v)
+{
+    buffer.push_back(v >> 24);
+    buffer.push_back(v >> 16);
+    buffer.push_back(v >> 8);
+    buffer.push_back(v);
+}
+
+static void append_chunk(vector<unsigned char>& buffer, const char *type, const vector<unsigned char>& payload)
+{
+    append_u32(buffer, payload.size());
+    size_t start = buffer.size();
+    buffer.insert(buffer.end(), type, type + 4);
+    buffer.insert(buffer.end(), payload.begin(), payload.end());
+    unsigned int crc = crc32_update(0xffffffffu, &buffer[start], buffer.size() - start) ^ 0xffffffffu;
+    append_u32(buffer, crc);
+}
+
+/* 8 bit RGB PNG. The scanlines use no filter and are stored in uncompressed
+deflate blocks, which keeps the encoder free of external libraries. */
+void Image::encodePNG(vector<unsigned char>& buffer) const
+{
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    buffer.insert(buffer.end(), signature, signature + 8);
+
+    vector<unsigned char> ihdr;
+    append_u32(ihdr, width);
+    append_u32(ihdr, height);
+    ihdr.push_back(8);  // bit depth
+    ihdr.push_back(2);  // color type RGB
+    ihdr.push_back(0);  // deflate
+    ihdr.push_back(0);  // adaptive filtering
+    ihdr.push_back(0);  // no interlace
+    append_chunk(buffer, "IHDR", ihdr);
+
+    // raw scanlines, each prefixed with filter type 0
+    size_t row_size = (size_t) width * 3 + 1;
+    vector<unsigned char> raw(row_size * height);
+    ConstImageView pixels = view();
+    for (int y = 0; y < height; y++)
+    {
+        raw[y * row_size] = 0;
+        memcpy(&raw[y * row_size + 1], pixels.row(y), (size_t) width * 3);
+    }
+
+    // zlib stream of stored blocks
+    vector<unsigned char> idat;
+    size_t num_blocks = (raw.size() + 65534) / 65535;
+    idat.reserve(raw.size() + num_blocks * 5 + 6);
+    idat.push_back(0x78);
+    idat.push_back(0x01);
+    size_t pos = 0;
+    do
+    {
+        size_t len = std::min(raw.size() - pos, (size_t) 65535);
+        bool last = (pos + len == raw.size());
+        idat.push_back(last ? 1 : 0);
+        idat.push_back(len & 0xff);
+        idat.push_back(len >> 8);
+        idat.push_back(~len & 0xff);
+        idat.push_back((~len >> 8) & 0xff);
+        idat.insert(idat.end(), raw.begin() + pos, raw.begin() + pos + len);
+        pos += len;
+    } while (pos < raw.size());
+
+    // adler32, 5552 is the largest run that cannot overflow before the modulo
+    unsigned int s1 = 1, s2 = 0;
+    for (size_t i = 0; i < raw.size(); )
+    {
+        size_t end = std::min(raw.size(), i + 5552);
+        for (; i < end; i++)
+        {
+            s1 += raw[i];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    append_u32(idat, (s2 << 16) | s1);
 
-	fclose(output);
+    append_chunk(buffer, "IDAT", idat);
+    append_chunk(buffer, "IEND", vector<unsigned char>());
 }
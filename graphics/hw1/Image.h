@@ -3,9 +3,12 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <vector>
 
 #include "defs.h"
 
+using namespace std;
+
 //
 // Access the color using either individual component names
 // or the channel array.
@@ -22,17 +25,75 @@ typedef union Color
     unsigned char channel[3];
 } Color;
 
-/* This class is provided to you for defining an image as a variable, manipulate it easily, and save it as a ppm file. */
+// Output file formats
+typedef enum ImageFormat
+{
+    IMAGE_FORMAT_AUTO,  // PNG for names ending in .png, ASCII PPM otherwise
+    IMAGE_FORMAT_P3,    // ASCII PPM
+    IMAGE_FORMAT_P6,    // Binary PPM
+    IMAGE_FORMAT_PNG    // PNG with uncompressed deflate blocks
+} ImageFormat;
+
+// Read only view of a block of pixels, handed to image writers and other readers
+typedef struct ConstImageView
+{
+    const Color* data;  // First pixel of the block
+    int width;          // Block width
+    int height;         // Block height
+    int stride;         // Distance between the starts of two rows, in pixels
+
+    const Color* row(int y) const { return data + (size_t) y * stride; }
+    const Color& at(int col, int row) const { return data[(size_t) row * stride + col]; }
+} ConstImageView;
+
+// Non owning view of a block of pixels. Views are cheap to copy, so render threads
+// pass them around instead of the image itself.
+typedef struct ImageView
+{
+    Color* data;    // First pixel of the block
+    int width;      // Block width
+    int height;     // Block height
+    int stride;     // Distance between the starts of two rows, in pixels
+
+    Color* row(int y) const { return data + (size_t) y * stride; }
+    Color& at(int col, int row) const { return data[(size_t) row * stride + col]; }
+
+    operator ConstImageView() const
+    {
+        ConstImageView view = {data, width, height, stride};
+        return view;
+    }
+} ImageView;
+
+/* This class is provided to you for defining an image as a variable, manipulate it easily, and save it as a ppm file. 
+The pixels live in one cache line aligned buffer, rows are padded to a multiple of 64 pixels. */
 class Image
 {
 public:
-    Color** data;                   // Image data
 	int width;						// Image width
 	int height;						// Image height
+	int stride;						// Row stride in pixels
 
 	Image(int width, int height);	// Constructor
+	~Image();						// Destructor, frees the pixel buffer
+	Image(Image&& other);			// Move constructor
+	Image(const Image&) = delete;
+	Image& operator=(const Image&) = delete;
+
+	ImageView view();				// View of the whole image
+	ConstImageView view() const;	// Read only view of the whole image
 	void setPixelValue(int col, int row, const Color& color); // Sets the value of the pixel at the given column and row
-	void saveImage(const char *imageName) const;	          // Takes the image name as a file and saves it as a ppm file. 
+	bool saveImage(const char *imageName, ImageFormat format = IMAGE_FORMAT_AUTO) const; // Takes the image name as a file and saves it in the given format, false if it could not be written
+
+	// Changes the extension of a size byte image name to the one of the format, false if the name was left as is
+	static bool matchExtension(char *imageName, size_t size, ImageFormat format);
+
+private:
+    Color* data;                    // Image data, height rows of stride pixels
+
+    void encodeP3(vector<unsigned char>& buffer) const;
+    void encodeP6(vector<unsigned char>& buffer) const;
+    void encodePNG(vector<unsigned char>& buffer) const;
 };
 
 #endif
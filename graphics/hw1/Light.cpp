@@ -6,6 +6,11 @@ PointLight::PointLight(const Vector3f & position, const Vector3f & intensity)
 {
 }
 
+const Vector3f& PointLight::getIntensity() const
+{
+    return intensity;
+}
+
 // Compute the contribution of light at point p using the
 // inverse square law formula
 Vector3f PointLight::computeLightContribution(const Vector3f& p)
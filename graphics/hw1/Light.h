@@ -13,8 +13,10 @@ public:
 
     PointLight(const Vector3f & position, const Vector3f & intensity);	// Constructor
     Vector3f computeLightContribution(const Vector3f& p); // Compute the contribution of light at point p
+    const Vector3f& getIntensity() const;	// Intensity of the light, bounds its contribution at any distance
 
 private:
+    friend class SceneCache;
 
     Vector3f intensity;	// Intensity of the point light
 };
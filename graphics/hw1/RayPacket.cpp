@@ -0,0 +1,17 @@
+#include "RayPacket.h"
+
+RayPacket::RayPacket(const Ray rays[PACKET_SIZE])
+{
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+        ox[i] = rays[i].origin.x;
+        oy[i] = rays[i].origin.y;
+        oz[i] = rays[i].origin.z;
+        dx[i] = rays[i].direction.x;
+        dy[i] = rays[i].direction.y;
+        dz[i] = rays[i].direction.z;
+        invx[i] = 1.0f / dx[i];
+        invy[i] = 1.0f / dy[i];
+        invz[i] = 1.0f / dz[i];
+    }
+}
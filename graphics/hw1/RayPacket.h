@@ -0,0 +1,26 @@
+#ifndef _RAYPACKET_H_
+#define _RAYPACKET_H_
+
+#include "Ray.h"
+#include "Simd.h"
+#include "defs.h"
+
+#define PACKET_SIZE 4	// Number of rays traced together, a 2x2 block of pixels
+
+// Structure of arrays layout of PACKET_SIZE rays, one SIMD lane per ray
+typedef struct RayPacket
+{
+	alignas(16) float ox[PACKET_SIZE];	// Origins
+	alignas(16) float oy[PACKET_SIZE];
+	alignas(16) float oz[PACKET_SIZE];
+	alignas(16) float dx[PACKET_SIZE];	// Directions
+	alignas(16) float dy[PACKET_SIZE];
+	alignas(16) float dz[PACKET_SIZE];
+	alignas(16) float invx[PACKET_SIZE];	// Inverse directions for the box tests
+	alignas(16) float invy[PACKET_SIZE];
+	alignas(16) float invz[PACKET_SIZE];
+
+	RayPacket(const Ray rays[PACKET_SIZE]);	// Constructor
+} RayPacket;
+
+#endif
@@ -0,0 +1,89 @@
+#include "ResidentSet.h"
+
+#include <algorithm>
+#include <sys/mman.h>
+
+ResidentSet::ResidentSet()
+    : base(nullptr), size(0), budget(0), residentBytes(0), hand(0), numPageIns(0), numEvictions(0)
+{
+}
+
+ResidentSet::~ResidentSet()
+{
+    if (base != nullptr)
+        munmap(base, size);
+}
+
+// The pages read so far are dropped and read ahead is turned off,
+// so only the clusters asked for are brought in from here on
+void ResidentSet::attach(void *mapping, size_t size, size_t budget)
+{
+    base = (unsigned char *) mapping;
+    this->size = size;
+    this->budget = budget;
+    madvise(base, size, MADV_DONTNEED);
+    madvise(base, size, MADV_RANDOM);
+}
+
+int ResidentSet::addRegion(size_t offset, size_t bytes)
+{
+    int first = offsets.size();
+    for (size_t begin = 0; begin < bytes; begin += CLUSTER_BYTES)
+    {
+        offsets.push_back(offset + begin);
+        lengths.push_back(std::min((size_t) CLUSTER_BYTES, bytes - begin));
+        resident.push_back(0);
+        referenced.emplace_back(false);
+    }
+    return first;
+}
+
+bool ResidentSet::attached() const
+{
+    return base != nullptr;
+}
+
+long long ResidentSet::pageIns() const
+{
+    return numPageIns;
+}
+
+long long ResidentSet::evictions() const
+{
+    return numEvictions;
+}
+
+/* The hand sweeps the clusters, clearing the reference bits it passes and evicting
+the first resident cluster whose bit is already clear. Two full turns are enough to
+find one, unless the cluster being paged in is the only one left. */
+void ResidentSet::pageIn(int cluster)
+{
+    lock_guard<mutex> guard(lock);
+    referenced[cluster].store(true, memory_order_relaxed);
+    if (resident[cluster])
+        return;
+
+    madvise(base + offsets[cluster], lengths[cluster], MADV_WILLNEED);
+    resident[cluster] = 1;
+    residentBytes += lengths[cluster];
+    numPageIns++;
+
+    size_t num_clusters = offsets.size();
+    for (size_t steps = 0; residentBytes > budget && steps < 2 * num_clusters; steps++)
+    {
+        size_t victim = hand;
+        hand = (hand + 1) % num_clusters;
+        if (victim == (size_t) cluster || !resident[victim])
+            continue;
+        if (referenced[victim].load(memory_order_relaxed))
+        {
+            referenced[victim].store(false, memory_order_relaxed);
+            continue;
+        }
+
+        madvise(base + offsets[victim], lengths[victim], MADV_DONTNEED);
+        resident[victim] = 0;
+        residentBytes -= lengths[victim];
+        numEvictions++;
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef _RESIDENTSET_H_
+#define _RESIDENTSET_H_
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+#define CLUSTER_BYTES (64 * 1024)	// Unit in which mapped geometry is paged in and out, a multiple of the page size
+
+/* Bounds how much of a read only file mapping stays in memory. The mapped
+regions are cut into clusters of CLUSTER_BYTES; readers report the cluster they
+are about to read through touch(), and once the clusters paged in exceed the
+budget the ones not touched recently are handed back to the kernel (CLOCK
+replacement). Dropped pages are read again from the file on the next access, so
+a cluster evicted while another thread still reads it only costs a page fault. */
+class ResidentSet
+{
+public:
+	ResidentSet();
+	~ResidentSet();	// Unmaps the file
+
+	void attach(void *mapping, size_t size, size_t budget);	// Takes over a mapping made with mmap
+	int addRegion(size_t offset, size_t bytes);	// Splits a page aligned range of the mapping into clusters and returns the first one.
+												// Regions are added before any reader starts.
+	bool attached() const;
+
+	inline void touch(int cluster)	// Marks a cluster as used and pages it in if needed
+	{
+		if (!referenced[cluster].load(memory_order_relaxed))
+			pageIn(cluster);
+	}
+
+	long long pageIns() const;		// Clusters paged in so far
+	long long evictions() const;	// Clusters handed back so far
+
+private:
+	unsigned char *base;
+	size_t size;
+	size_t budget;
+
+	vector<size_t> offsets;
+	vector<size_t> lengths;
+	vector<unsigned char> resident;
+	deque<atomic<bool>> referenced;	// Set by touch, cleared by the clock hand
+
+	mutex lock;
+	size_t residentBytes;
+	size_t hand;
+	long long numPageIns;
+	long long numEvictions;
+
+	void pageIn(int cluster);
+};
+
+#endif
@@ -3,115 +3,763 @@
 #include "Light.h"
 #include "Material.h"
 #include "Shape.h"
+#include "SceneCache.h"
+#include "GBuffer.h"
+#include "Stats.h"
+#include "ThreadPool.h"
+#include "WorkerPool.h"
+#include "Animation.h"
 #include "tinyxml2.h"
+#include <cctype>
+#include <charconv>
+#include <algorithm>
+#include <memory>
 
 using namespace tinyxml2;
 
+// Image and bookkeeping of one camera while the cameras are rendered together
+typedef struct CameraJob
+{
+	Camera* cam;
+	Image image;
+	ImageView pixels;
+	int numTiles;
+	int firstTask;				// Index of the first tile of the camera in the shared task list
+	CameraStats stats;
+	vector<double> finishSeconds;	// Per worker, end of the last tile of the camera since the start of the batch
+	vector<unsigned char> edges;	// Pixels marked for anti-aliasing
+	vector<GBufferPixel> gbuffer;	// Primary hits, only used with saveGBuffer or relight
+	bool relit;						// Whether the image is shaded from a stored G-buffer
+
+	CameraJob(Camera* cam, int numWorkers, int firstTask)
+		: cam(cam), image(cam->imgPlane.nx, cam->imgPlane.ny), firstTask(firstTask), finishSeconds(numWorkers, 0), relit(false)
+	{
+		int rows = cam->imgPlane.ny, cols = cam->imgPlane.nx;
+		pixels = image.view();
+		numTiles = ((cols + TILE_SIZE - 1) / TILE_SIZE) * ((rows + TILE_SIZE - 1) / TILE_SIZE);
+		stats.imageName = cam->imageName;
+		stats.width = cols;
+		stats.height = rows;
+		stats.threads.resize(numWorkers);
+	}
+} CameraJob;
+
+// Result of a tile rendered by a worker process, followed by the pixels of the tile row by row
+typedef struct TileReply
+{
+	RayCounters counters;
+	double seconds;
+} TileReply;
+
 /* 
  * Must render the scene from each camera's viewpoint and create an image.
  * You can use the methods of the Image class to save the image as a PPM file. 
  */
 void Scene::renderScene(void)
 {
+	ThreadPool pool(numThreads);
+	buildLightBVH();
+
+	// the cameras to render, all of them unless a subset was selected by id
+	vector<Camera *> selected;
 	for (Camera* cam : cameras)
 	{
-		int rows = cam->imgPlane.ny, cols = cam->imgPlane.nx;
-		Image image(cols, rows);
+		if (cameraIds.empty() || std::find(cameraIds.begin(), cameraIds.end(), cam->id) != cameraIds.end())
+			selected.push_back(cam);
+	}
+	for (int id : cameraIds)
+	{
+		if (std::none_of(cameras.begin(), cameras.end(), [&](const Camera* cam) { return cam->id == id; }))
+			fprintf(stderr, "no camera with id %d\n", id);
+	}
 
-		for (int i = 0; i < rows; i++)
+	// worker processes only take the tiles of a plain render, the other modes keep their state in this process
+	bool distributed = numWorkers > 0 && !progressive && !saveGBuffer && !relight;
+	if (numWorkers > 0 && !distributed)
+		fprintf(stderr, "worker processes are not used with --progressive, --gbuffer or --relight\n");
+	// progressive passes trace their own pixels, the G-buffer is only read and written by a plain render
+	if (progressive && (saveGBuffer || relight))
+		fprintf(stderr, "--gbuffer and --relight are not used with --progressive\n");
+
+	// All cameras are rendered together: the tiles of every camera form one list
+	// of tasks, so the threads stay busy until the last tile of the last camera.
+	// With worker processes the stats have a slot per worker and one for this process.
+	int num_slots = distributed ? std::max(pool.size(), numWorkers + 1) : pool.size();
+	vector<CameraJob> jobs;
+	jobs.reserve(selected.size());
+	int num_tasks = 0;
+	for (Camera* cam : selected)
+	{
+		jobs.emplace_back(cam, num_slots, num_tasks);
+		num_tasks += jobs.back().numTiles;
+	}
+
+	auto job_of = [&](int task) -> CameraJob& {
+		return *(std::upper_bound(jobs.begin(), jobs.end(), task, [](int task, const CameraJob& job) { return task < job.firstTask; }) - 1);
+	};
+
+	// The workers are forked once the cameras are set up and serve tiles of any camera.
+	// Each renders into its own copy of the images and sends back the tile.
+	unique_ptr<WorkerPool> farm;
+	if (distributed)
+	{
+		farm.reset(new WorkerPool(numWorkers, [&](int task, vector<unsigned char>& result) {
+			CameraJob& job = job_of(task);
+			int tile = task - job.firstTask;
+			int row_begin, row_end, col_begin, col_end;
+			tileBounds(job.cam, tile, row_begin, row_end, col_begin, col_end);
+
+			TileReply reply;
+			double tile_start = currentSeconds();
+			RayCounters before = rayCounters;
+			renderTile(job.cam, job.pixels, tile);
+			reply.counters = rayCounters - before;
+			reply.seconds = currentSeconds() - tile_start;
+
+			size_t row_bytes = (col_end - col_begin) * sizeof(Color);
+			result.resize(sizeof(reply) + (row_end - row_begin) * row_bytes);
+			memcpy(result.data(), &reply, sizeof(reply));
+			for (int i = row_begin; i < row_end; i++)
+				memcpy(result.data() + sizeof(reply) + (i - row_begin) * row_bytes, &job.pixels.at(col_begin, i), row_bytes);
+		}));
+	}
+
+	double start = currentSeconds();
+
+	// runs render(job, tile) on every tile of every camera and adds the work to the stats of the camera
+	auto render_tiles = [&](auto render) {
+		pool.run(num_tasks, [&](int task, int worker) {
+			CameraJob& job = job_of(task);
+			double tile_start = currentSeconds();
+			RayCounters before = rayCounters;
+			render(job, task - job.firstTask);
+			double tile_end = currentSeconds();
+			ThreadStats& thread_stats = job.stats.threads[worker];
+			thread_stats.counters += rayCounters - before;
+			thread_stats.renderSeconds += tile_end - tile_start;
+			job.finishSeconds[worker] = tile_end - start;
+		});
+	};
+
+	if (progressive)
+	{
+		// coarse to fine passes, every pass only traces the pixels the earlier ones
+		// skipped and writes a preview with the missing pixels filled in
+		for (int step = PROGRESSIVE_STEP; step >= 1 && !cancelled; step /= 2)
+		{
+			bool first = (step == PROGRESSIVE_STEP);
+			render_tiles([&](CameraJob& job, int tile) {
+				if (!cancelled)
+					renderTileProgressive(job.cam, job.pixels, tile, step, first);
+			});
+			if (cancelled || step == 1)
+				break;
+
+			pool.run(jobs.size(), [&](int j, int worker) {
+				fillPreview(jobs[j].pixels, step);
+				if (!jobs[j].image.saveImage(jobs[j].cam->imageName, imageFormat))
+					fprintf(stderr, "could not write %s\n", jobs[j].cam->imageName);
+			});
+		}
+	}
+	else
+	{
+		// cameras with a valid G-buffer are relit from it, the others are traced and record one when asked to
+		for (CameraJob& job : jobs)
 		{
-			for (int j = 0; j < cols; j++)
+			if (relight)
 			{
-				Ray ray = cam->getPrimaryRay(j, i);
-				Vector3f color = calculate_pixel_color(ray, maxRecursionDepth);
-				Color result = {(unsigned char) std::round(std::min(color.x, 255.0f)), (unsigned char) std::round(std::min(color.y, 255.0f)), (unsigned char) std::round(std::min(color.z, 255.0f))};
-				image.setPixelValue(j, i, result);				
+				job.relit = GBuffer::load(*this, *job.cam, job.gbuffer);
+				if (!job.relit)
+					fprintf(stderr, "no valid G-buffer for %s, tracing primary rays\n", job.cam->imageName);
 			}
+			if (!job.relit && saveGBuffer)
+				job.gbuffer.resize((size_t) job.pixels.width * job.pixels.height);
+		}
+
+		if (distributed)
+		{
+			farm->run(num_tasks, [&](int task, int worker, const vector<unsigned char>& result) {
+				CameraJob& job = job_of(task);
+				int row_begin, row_end, col_begin, col_end;
+				tileBounds(job.cam, task - job.firstTask, row_begin, row_end, col_begin, col_end);
+
+				size_t row_bytes = (col_end - col_begin) * sizeof(Color);
+				if (result.size() != sizeof(TileReply) + (row_end - row_begin) * row_bytes)
+					return false;
+
+				TileReply reply;
+				memcpy(&reply, result.data(), sizeof(reply));
+				for (int i = row_begin; i < row_end; i++)
+					memcpy(&job.pixels.at(col_begin, i), result.data() + sizeof(reply) + (i - row_begin) * row_bytes, row_bytes);
+
+				ThreadStats& worker_stats = job.stats.threads[worker];
+				worker_stats.counters += reply.counters;
+				worker_stats.renderSeconds += reply.seconds;
+				job.finishSeconds[worker] = currentSeconds() - start;
+				return true;
+			});
+		}
+		else
+		{
+			render_tiles([&](CameraJob& job, int tile) {
+				if (job.gbuffer.empty())
+					renderTile(job.cam, job.pixels, tile);
+				else
+					renderTileGBuffer(job.cam, job.pixels, job.gbuffer, job.relit, tile);
+			});
 		}
 
-		image.saveImage(cam->imageName);
+		for (CameraJob& job : jobs)
+		{
+			if (!job.relit && saveGBuffer && !GBuffer::save(*this, *job.cam, job.gbuffer))
+				fprintf(stderr, "could not write the G-buffer of %s\n", job.cam->imageName);
+		}
+	}
+
+	// adaptive anti-aliasing: the pixels that differ from a neighbor are found on the
+	// whole one sample image first, then only those are supersampled
+	if (aaMaxSamples > 1 && !cancelled)
+	{
+		for (CameraJob& job : jobs)
+			job.edges.resize(job.pixels.width * job.pixels.height);
+		pool.run(num_tasks, [&](int task, int worker) {
+			CameraJob& job = job_of(task);
+			markEdges(job.cam, job.pixels, job.edges, task - job.firstTask);
+		});
+		render_tiles([&](CameraJob& job, int tile) {
+			refineTile(job.cam, job.pixels, job.edges, tile);
+		});
 	}
+
+	// the frames of an animation add up, like their rays and cameras
+	stats.renderSeconds += currentSeconds() - start;
+	stats.clusterPageIns = residentSet.pageIns();
+	stats.clusterEvictions = residentSet.evictions();
+	for (CameraJob& job : jobs)
+	{
+		job.stats.renderSeconds = *std::max_element(job.finishSeconds.begin(), job.finishSeconds.end());
+		stats.cameras.push_back(job.stats);
+	}
+
+	// a cancelled progressive render leaves the preview of the last finished pass
+	if (cancelled)
+		return;
+	pool.run(jobs.size(), [&](int j, int worker) {
+		if (!jobs[j].image.saveImage(jobs[j].cam->imageName, imageFormat))
+			fprintf(stderr, "could not write %s\n", jobs[j].cam->imageName);
+	});
 }
 
-// tracer function
-Vector3f Scene::calculate_pixel_color(Ray ray, int recDepth)
+// Renders a tile one pixel at a time through the G-buffer. When relighting, the primary
+// hits are read from the buffer instead of traced, otherwise they are stored into it.
+void Scene::renderTileGBuffer(const Camera* cam, const ImageView& image, vector<GBufferPixel>& gbuffer, bool relit, int tile)
+{
+	int row_begin, row_end, col_begin, col_end;
+	tileBounds(cam, tile, row_begin, row_end, col_begin, col_end);
+
+	for (int i = row_begin; i < row_end; i++)
+	{
+		for (int j = col_begin; j < col_end; j++)
+		{
+			GBufferPixel& pixel = gbuffer[(size_t) i * image.width + j];
+			Ray ray = cam->getPrimaryRay(j, i);
+			ReturnVal final_res;
+			if (relit)
+			{
+				final_res.intersects = pixel.material != 0;
+				final_res.t = pixel.t;
+				final_res.intersection_point = pixel.position;
+				final_res.normal = pixel.normal;
+				final_res.material_index = pixel.material;
+			}
+			else
+			{
+				rayCounters.primaryRays++;
+				HitRecord hit = closestHit(ray);
+				final_res = hitAttributes(ray, hit);
+				pixel.t = final_res.t;
+				pixel.material = final_res.intersects ? final_res.material_index : 0;
+				if (final_res.intersects)
+				{
+					pixel.position = final_res.intersection_point;
+					pixel.normal = final_res.normal;
+					pixel.objectType = hit.objectType;
+					pixel.object = hit.object;
+					pixel.prim = (hit.objectType == OBJECT_MESH || hit.objectType == OBJECT_INSTANCE) ? hit.prim : 0;
+				}
+				else
+				{
+					pixel.position = pixel.normal = Vector3f(0, 0, 0);
+					pixel.objectType = pixel.prim = 0;
+					pixel.object = -1;
+				}
+			}
+
+			Vector3f color = shade(ray, final_res, maxRecursionDepth);
+			Color result = {(unsigned char) std::round(std::min(color.x, 255.0f)), (unsigned char) std::round(std::min(color.y, 255.0f)), (unsigned char) std::round(std::min(color.z, 255.0f))};
+			image.at(j, i) = result;
+		}
+	}
+}
+
+// Traces the pixels of a tile that lie on the grid of the given step. Pixels that
+// are also on the grid of twice the step were traced by the previous pass and are kept.
+void Scene::renderTileProgressive(const Camera* cam, const ImageView& image, int tile, int step, bool first)
+{
+	int row_begin, row_end, col_begin, col_end;
+	tileBounds(cam, tile, row_begin, row_end, col_begin, col_end);
+
+	for (int i = row_begin; i < row_end; i += step)
+	{
+		for (int j = col_begin; j < col_end; j += step)
+		{
+			if (!first && i % (2 * step) == 0 && j % (2 * step) == 0)
+				continue;
+
+			Ray ray = cam->getPrimaryRay(j, i);
+			rayCounters.primaryRays++;
+			Vector3f color = calculate_pixel_color(ray, maxRecursionDepth);
+			Color result = {(unsigned char) std::round(std::min(color.x, 255.0f)), (unsigned char) std::round(std::min(color.y, 255.0f)), (unsigned char) std::round(std::min(color.z, 255.0f))};
+			image.at(j, i) = result;
+		}
+	}
+}
+
+// Copies every traced pixel of the given grid into the step x step block it covers.
+// Only pixels off the grid are written, and those are all traced by later passes.
+void Scene::fillPreview(const ImageView& image, int step) const
 {
-	float tmin = std::numeric_limits<float>::infinity();
-	Shape* final_obj = nullptr;
-	ReturnVal final_res;
-	ReturnVal object_res;
-	for (Shape* object : objects)
+	for (int i = 0; i < image.height; i++)
 	{
-		object_res = object->intersect(ray);
-		if (object_res.intersects && object_res.t < tmin)
+		Color* row = image.row(i);
+		const Color* source = image.row(i - i % step);
+		for (int j = 0; j < image.width; j++)
 		{
-			tmin = object_res.t;
-			final_obj = object;
-			final_res = object_res;
+			if (i % step != 0 || j % step != 0)
+				row[j] = source[j - j % step];
 		}
 	}
+}
 
-	if (final_obj != nullptr)
+// Pixel range of a TILE_SIZE x TILE_SIZE block of the image, tiles are numbered row by row
+void Scene::tileBounds(const Camera* cam, int tile, int& row_begin, int& row_end, int& col_begin, int& col_end) const
+{
+	int rows = cam->imgPlane.ny, cols = cam->imgPlane.nx;
+	int tiles_x = (cols + TILE_SIZE - 1) / TILE_SIZE;
+	row_begin = (tile / tiles_x) * TILE_SIZE;
+	col_begin = (tile % tiles_x) * TILE_SIZE;
+	row_end = std::min(row_begin + TILE_SIZE, rows);
+	col_end = std::min(col_begin + TILE_SIZE, cols);
+}
+
+// Renders one tile of the image with one sample per pixel
+void Scene::renderTile(const Camera* cam, const ImageView& image, int tile)
+{
+	int row_begin, row_end, col_begin, col_end;
+	tileBounds(cam, tile, row_begin, row_end, col_begin, col_end);
+
+	if (wavefront)
 	{
-		Vector3f color(0, 0, 0);
-		Material mat = *(materials[final_obj->matIndex - 1]);
+		renderTileWavefront(cam, image, row_begin, row_end, col_begin, col_end);
+		return;
+	}
 
-		// ambient shading
-		color = color + ambientLight.pointwise_multiplication(mat.ambientRef);
+	if (packetTracing)
+	{
+		renderTilePackets(cam, image, row_begin, row_end, col_begin, col_end);
+		return;
+	}
 
-		for (PointLight* plight : lights)
+	for (int i = row_begin; i < row_end; i++)
+	{
+		for (int j = col_begin; j < col_end; j++)
 		{
-			// vector from intersection point on object to the point light
-			Vector3f light_dir = plight->position - final_res.intersection_point;
-			Vector3f light_dir_normalized = light_dir.normalize();
+			Ray ray = cam->getPrimaryRay(j, i);
+			rayCounters.primaryRays++;
+			Vector3f color = calculate_pixel_color(ray, maxRecursionDepth);
+			Color result = {(unsigned char) std::round(std::min(color.x, 255.0f)), (unsigned char) std::round(std::min(color.y, 255.0f)), (unsigned char) std::round(std::min(color.z, 255.0f))};
+			image.at(j, i) = result;
+		}
+	}
+}
 
-			int shadow_flag = 0;
-			for (Shape* obj_i : objects)
-			{
-				Ray light_ray(final_res.intersection_point + (light_dir_normalized * shadowRayEps), light_dir_normalized);
-				ReturnVal shadow_res = obj_i->intersect(light_ray);
-				if (shadow_res.intersects && shadow_res.t < light_dir.length() - shadowRayEps)
-				{
-					shadow_flag = 1;
-					break;
-				}
-			}
+// Adds the primitive tests of one traversal to the counters of the thread. Meshes
+// and instances count the faces they test themselves.
+template <typename T>
+static void count_tests(int /*tests*/)
+{
+}
+
+template <>
+void count_tests<Sphere>(int tests)
+{
+	rayCounters.sphereTests += tests;
+}
+
+template <>
+void count_tests<Triangle>(int tests)
+{
+	rayCounters.triangleTests += tests;
+}
+
+// Closest hit search among the shapes of one type. The loop is specialized per type,
+// so the shapes are tested without any indirect call.
+template <typename T>
+static void intersect_shapes(const vector<T>& shapes, const BVH& bvh, int type, const Ray& ray, HitRecord& hit)
+{
+	float tmin = hit.t;
+	int tests = bvh.traverse(ray, tmin, [&](int i, float& tmax) {
+		if (shapes[i].intersectHit(ray, hit))
+		{
+			hit.objectType = type;
+			hit.object = i;
+			tmax = hit.t;
+		}
+	});
+	count_tests<T>(tests);
+}
+
+// Packet version of intersect_shapes
+template <typename T>
+static void intersect_shapes_packet(const vector<T>& shapes, const BVH& bvh, int type, const RayPacket& packet, HitRecord hits[PACKET_SIZE])
+{
+	float tmin[PACKET_SIZE];
+	for (int lane = 0; lane < PACKET_SIZE; lane++)
+		tmin[lane] = hits[lane].t;
 
-			if (shadow_flag == 1)
+	int tests = bvh.traversePacket(packet, tmin, [&](int i, float* tmax) {
+		int mask = shapes[i].intersectPacket(packet, hits);
+		for (int lane = 0; lane < PACKET_SIZE; lane++)
+		{
+			if (mask & (1 << lane))
 			{
-				//shadow_flag = 0;
-				continue;
+				hits[lane].objectType = type;
+				hits[lane].object = i;
+				tmax[lane] = hits[lane].t;
 			}
+		}
+	});
+	count_tests<T>(tests * PACKET_SIZE);
+}
 
-			// diffuse shading
-			float costheta_temp = final_res.normal * light_dir_normalized;
-			float costheta = (costheta_temp > 0) ? costheta_temp : 0;
+template <typename T>
+static bool occluded_shapes(const vector<T>& shapes, const BVH& bvh, const Ray& ray, float tmax)
+{
+	int tests = 0;
+	bool occluded = bvh.occluded(ray, tmax, [&](int i, float tmax) {
+		return shapes[i].occluded(ray, tmax);
+	}, tests);
+	count_tests<T>(tests);
+	return occluded;
+}
 
-			Vector3f plight_contribution = plight->computeLightContribution(final_res.intersection_point);
-			color = color + mat.diffuseRef.pointwise_multiplication(plight_contribution) * costheta;
+template <typename T>
+static void build_shapes_bvh(const vector<T>& shapes, BVH& bvh)
+{
+	vector<AABB> bounds(shapes.size());
+	for (size_t i = 0; i < shapes.size(); i++)
+	{
+		bounds[i] = shapes[i].getBoundingBox();
+	}
+	bvh.build(bounds);
+}
 
-			// specular shading
-			// bisector of the angle between light_dir_normalized and -ray.direction
-			Vector3f half_vector = (light_dir_normalized - ray.direction).normalize();
-			float cosalpha_temp = final_res.normal * half_vector;
-			float cosalpha = (cosalpha_temp > 0) ? cosalpha_temp : 0;
-			color = color + mat.specularRef.pointwise_multiplication(plight_contribution) * pow(cosalpha, mat.phongExp);
+// closest hit search through the shape BVHs, the hit information is only filled in for the final hit
+ReturnVal Scene::intersect(const Ray& ray) const
+{
+	return hitAttributes(ray, closestHit(ray));
+}
 
-			// mirror reflection
-			if (recDepth > 0 && ! mat.mirrorRef.is_zero())
-			{
-				Vector3f r = (ray.direction - (final_res.normal * ((ray.direction * final_res.normal) * 2))).normalize();
-				Ray reflection_ray(final_res.intersection_point + r * shadowRayEps, r);
+HitRecord Scene::closestHit(const Ray& ray) const
+{
+	HitRecord hit;
+	hit.t = std::numeric_limits<float>::infinity();
+	hit.object = -1;
+
+	intersect_shapes(spheres, sphereBVH, OBJECT_SPHERE, ray, hit);
+	intersect_shapes(triangles, triangleBVH, OBJECT_TRIANGLE, ray, hit);
+	intersect_shapes(meshes, meshBVH, OBJECT_MESH, ray, hit);
+	intersect_shapes(instances, instanceBVH, OBJECT_INSTANCE, ray, hit);
+	return hit;
+}
 
-				color = color + calculate_pixel_color(reflection_ray, recDepth - 1).pointwise_multiplication(mat.mirrorRef);
+// surface information of the hit found by the closest hit search
+ReturnVal Scene::hitAttributes(const Ray& ray, const HitRecord& hit) const
+{
+	if (hit.object == -1)
+	{
+		ReturnVal final_res;
+		final_res.intersects = false;
+		final_res.t = hit.t;
+		return final_res;
+	}
+
+	switch (hit.objectType)
+	{
+	case OBJECT_SPHERE:
+		return spheres[hit.object].hitAttributes(ray, hit);
+	case OBJECT_TRIANGLE:
+		return triangles[hit.object].hitAttributes(ray, hit);
+	case OBJECT_MESH:
+		return meshes[hit.object].hitAttributes(ray, hit);
+	default:
+		return instances[hit.object].hitAttributes(ray, hit);
+	}
+}
+
+// Packet version of the tile loop, primary rays of each 2x2 pixel block are traced together.
+// Lanes that fall outside the image repeat a pixel inside it and are not written.
+void Scene::renderTilePackets(const Camera* cam, const ImageView& image, int row_begin, int row_end, int col_begin, int col_end)
+{
+	Ray rays[PACKET_SIZE];
+	ReturnVal results[PACKET_SIZE];
+
+	for (int i = row_begin; i < row_end; i += 2)
+	{
+		for (int j = col_begin; j < col_end; j += 2)
+		{
+			for (int lane = 0; lane < PACKET_SIZE; lane++)
+			{
+				int row = std::min(i + lane / 2, row_end - 1);
+				int col = std::min(j + lane % 2, col_end - 1);
+				rays[lane] = cam->getPrimaryRay(col, row);
 			}
 
+			RayPacket packet(rays);
+			rayCounters.primaryRays += PACKET_SIZE;
+			intersectPacket(packet, rays, results);
 
+			for (int lane = 0; lane < PACKET_SIZE; lane++)
+			{
+				int row = i + lane / 2;
+				int col = j + lane % 2;
+				if (row >= row_end || col >= col_end)
+					continue;
+				Vector3f color = shade(rays[lane], results[lane], maxRecursionDepth);
+				Color result = {(unsigned char) std::round(std::min(color.x, 255.0f)), (unsigned char) std::round(std::min(color.y, 255.0f)), (unsigned char) std::round(std::min(color.z, 255.0f))};
+				image.at(col, row) = result;
+			}
 		}
+	}
+}
+
+// any-hit search for shadow rays, returns at the first object hit before tmax
+bool Scene::occluded(const Ray& ray, float tmax) const
+{
+	return occluded_shapes(spheres, sphereBVH, ray, tmax) ||
+	       occluded_shapes(triangles, triangleBVH, ray, tmax) ||
+	       occluded_shapes(meshes, meshBVH, ray, tmax) ||
+	       occluded_shapes(instances, instanceBVH, ray, tmax);
+}
+
+// closest hit search for a packet of rays through the shape BVHs
+void Scene::intersectPacket(const RayPacket& packet, const Ray rays[PACKET_SIZE], ReturnVal results[PACKET_SIZE]) const
+{
+	HitRecord hits[PACKET_SIZE];
+	for (int lane = 0; lane < PACKET_SIZE; lane++)
+	{
+		hits[lane].t = std::numeric_limits<float>::infinity();
+		hits[lane].object = -1;
+	}
+
+	intersect_shapes_packet(spheres, sphereBVH, OBJECT_SPHERE, packet, hits);
+	intersect_shapes_packet(triangles, triangleBVH, OBJECT_TRIANGLE, packet, hits);
+	intersect_shapes_packet(meshes, meshBVH, OBJECT_MESH, packet, hits);
+	intersect_shapes_packet(instances, instanceBVH, OBJECT_INSTANCE, packet, hits);
+
+	for (int lane = 0; lane < PACKET_SIZE; lane++)
+	{
+		results[lane] = hitAttributes(rays[lane], hits[lane]);
+	}
+}
+
+// tracer function
+Vector3f Scene::calculate_pixel_color(Ray ray, int recDepth)
+{
+	return shade(ray, intersect(ray), recDepth);
+}
+
+// x^n for an integer exponent by repeated squaring, evaluated in double like
+// std::pow(float, int). Every squaring rounds, so large exponents can end up an
+// ulp away from std::pow, the sample scenes render bit-identical with it.
+static inline double int_pow(double x, int n)
+{
+	bool invert = n < 0;
+	unsigned int e = invert ? -(unsigned int) n : n;
+	double result = 1;
+	while (e > 0)
+	{
+		if (e & 1)
+			result *= x;
+		x *= x;
+		e >>= 1;
+	}
+	return invert ? 1 / result : result;
+}
+
+// diffuse and specular terms of a light that is not in shadow, terms that are
+// switched off belong to materials whose coefficients are zero
+template <bool Diffuse, bool Specular>
+static inline void add_light_terms(Vector3f& color, const Ray& ray, const ReturnVal& final_res, const Material& mat, PointLight* plight, const Vector3f& light_dir_normalized)
+{
+	Vector3f plight_contribution = plight->computeLightContribution(final_res.intersection_point);
+
+	// diffuse shading
+	if (Diffuse)
+	{
+		float costheta_temp = final_res.normal * light_dir_normalized;
+		float costheta = (costheta_temp > 0) ? costheta_temp : 0;
+		color = color + mat.diffuseRef.pointwise_multiplication(plight_contribution) * costheta;
+	}
+
+	// specular shading
+	// bisector of the angle between light_dir_normalized and -ray.direction
+	if (Specular)
+	{
+		Vector3f half_vector = (light_dir_normalized - ray.direction).normalize();
+		float cosalpha_temp = final_res.normal * half_vector;
+		float cosalpha = (cosalpha_temp > 0) ? cosalpha_temp : 0;
+		color = color + mat.specularRef.pointwise_multiplication(plight_contribution) * int_pow(cosalpha, mat.phongExp);
+	}
+}
+
+// Shading of a hit on a material with the given feature set. A zero term adds
+// exactly nothing to the color, so skipping it leaves the result unchanged.
+template <bool Diffuse, bool Specular, bool Mirror>
+Vector3f Scene::shadeMaterial(const Ray& ray, const ReturnVal& final_res, int recDepth)
+{
+	const Material& mat = *(materials[final_res.material_index - 1]);
+
+	// ambient shading
+	Vector3f color(0, 0, 0);
+	color = color + ambientLight.pointwise_multiplication(mat.ambientRef);
+
+	// the lights only matter for the terms below, without them no shadow ray is needed
+	bool mirror = Mirror && recDepth > 0;
+	if (!Diffuse && !Specular && !mirror)
 		return color;
 
+	// one list per recursion depth, the reflection rays below reuse the deeper ones
+	static thread_local vector<vector<int>> light_lists;
+	if ((int) light_lists.size() <= maxRecursionDepth)
+		light_lists.resize(maxRecursionDepth + 1);
+	vector<int>& light_list = light_lists[recDepth];
+	gatherLights(final_res, light_list);
+
+	for (int l : light_list)
+	{
+		PointLight* plight = lights[l];
+		Vector3f light_dir_normalized;
+		float light_tmax;
+		Ray light_ray = shadowRay(final_res, plight, light_dir_normalized, light_tmax);
+		rayCounters.shadowRays++;
+		if (occluded(light_ray, light_tmax))
+		{
+			continue;
+		}
+
+		if (Diffuse || Specular)
+			add_light_terms<Diffuse, Specular>(color, ray, final_res, mat, plight, light_dir_normalized);
 
+		// mirror reflection
+		if (mirror)
+		{
+			Ray reflection_ray = reflectionRay(ray, final_res);
+			rayCounters.reflectionRays++;
 
+			color = color + calculate_pixel_color(reflection_ray, recDepth - 1).pointwise_multiplication(mat.mirrorRef);
+		}
+	}
+	return color;
+}
+
+// shading kernels indexed by the feature bits of a material
+const Scene::ShadeKernel Scene::shadeKernels[8] = {
+	&Scene::shadeMaterial<false, false, false>, &Scene::shadeMaterial<false, false, true>,
+	&Scene::shadeMaterial<false, true, false>, &Scene::shadeMaterial<false, true, true>,
+	&Scene::shadeMaterial<true, false, false>, &Scene::shadeMaterial<true, false, true>,
+	&Scene::shadeMaterial<true, true, false>, &Scene::shadeMaterial<true, true, true>
+};
+
+// Records which reflection terms every material has, the shading kernel of a hit is picked from them
+void Scene::selectShadingKernels(void)
+{
+	materialFeatures.resize(materials.size());
+	materialReflectance.resize(materials.size());
+	for (size_t i = 0; i < materials.size(); i++)
+	{
+		const Material& mat = *materials[i];
+		materialFeatures[i] = (mat.diffuseRef.is_zero() ? 0 : MATERIAL_DIFFUSE) |
+		                      (mat.specularRef.is_zero() ? 0 : MATERIAL_SPECULAR) |
+		                      (mat.mirrorRef.is_zero() ? 0 : MATERIAL_MIRROR);
+		materialReflectance[i] = mat.diffuseRef + mat.specularRef;
+	}
+}
+
+static float max_channel(const Vector3f& v)
+{
+	return std::max(v.x, std::max(v.y, v.z));
+}
+
+/* A light adds at most intensity * (diffuse + specular) / distance^2 to a hit, as
+the cosine terms never exceed one. With the largest reflectance of the scene this
+gives the radius beyond which a light stays below lightCutoff on every material;
+the BVH over these spheres finds the lights worth a shadow ray at a point. */
+void Scene::buildLightBVH(void)
+{
+	lightBVH = BVH();
+	if (lightCutoff <= 0)
+		return;
+
+	float reflectance = 0;
+	for (size_t i = 0; i < materials.size(); i++)
+	{
+		if (!(materialFeatures[i] & MATERIAL_MIRROR))
+			reflectance = std::max(reflectance, max_channel(materialReflectance[i]));
+	}
+
+	vector<AABB> bounds(lights.size());
+	for (size_t l = 0; l < lights.size(); l++)
+	{
+		float radius = std::sqrt(max_channel(lights[l]->getIntensity()) * reflectance / lightCutoff);
+		bounds[l].expand(lights[l]->position - Vector3f(radius, radius, radius));
+		bounds[l].expand(lights[l]->position + Vector3f(radius, radius, radius));
+	}
+	lightBVH.build(bounds);
+}
+
+/* Mirror materials keep every light: the reflection is added once per light that
+reaches the hit, however faint, so culling would darken the mirror. */
+void Scene::gatherLights(const ReturnVal& final_res, vector<int>& out) const
+{
+	out.clear();
+	int index = final_res.material_index - 1;
+	if (lightCutoff <= 0 || (materialFeatures[index] & MATERIAL_MIRROR))
+	{
+		for (size_t l = 0; l < lights.size(); l++)
+			out.push_back(l);
+		return;
+	}
+
+	const Vector3f& p = final_res.intersection_point;
+	const Vector3f& reflectance = materialReflectance[index];
+	lightBVH.query(p, [&](int l) {
+		Vector3f d = lights[l]->position - p;
+		if (max_channel(lights[l]->getIntensity().pointwise_multiplication(reflectance)) >= lightCutoff * (d * d))
+			out.push_back(l);
+	});
+
+	// the leaves are not in light order, the colors are summed in scene order
+	std::sort(out.begin(), out.end());
+}
+
+// shading of the closest hit of a ray, traces the shadow and mirror rays it needs
+Vector3f Scene::shade(const Ray& ray, const ReturnVal& final_res, int recDepth)
+{
+	if (final_res.intersects)
+	{
+		return (this->*shadeKernels[materialFeatures[final_res.material_index - 1]])(ray, final_res, recDepth);
 	}
 	else
 	{
@@ -119,17 +767,108 @@ Vector3f Scene::calculate_pixel_color(Ray ray, int recDepth)
 	}
 }
 
+// ray from the hit point towards a point light, tmax is set to the distance of the light
+Ray Scene::shadowRay(const ReturnVal& final_res, PointLight* plight, Vector3f& light_dir_normalized, float& tmax) const
+{
+	// vector from intersection point on object to the point light
+	Vector3f light_dir = plight->position - final_res.intersection_point;
+	light_dir_normalized = light_dir.normalize();
+	tmax = light_dir.length() - shadowRayEps;
+	return Ray(final_res.intersection_point + (light_dir_normalized * shadowRayEps), light_dir_normalized);
+}
+
+// adds the diffuse and specular terms of a light that is not in shadow
+void Scene::addLightContribution(Vector3f& color, const Ray& ray, const ReturnVal& final_res, const Material& mat, PointLight* plight, const Vector3f& light_dir_normalized) const
+{
+	int features = materialFeatures[final_res.material_index - 1];
+	if ((features & MATERIAL_DIFFUSE) && (features & MATERIAL_SPECULAR))
+		add_light_terms<true, true>(color, ray, final_res, mat, plight, light_dir_normalized);
+	else if (features & MATERIAL_DIFFUSE)
+		add_light_terms<true, false>(color, ray, final_res, mat, plight, light_dir_normalized);
+	else if (features & MATERIAL_SPECULAR)
+		add_light_terms<false, true>(color, ray, final_res, mat, plight, light_dir_normalized);
+}
+
+// mirror reflection of the ray at the hit point
+Ray Scene::reflectionRay(const Ray& ray, const ReturnVal& final_res) const
+{
+	Vector3f r = (ray.direction - (final_res.normal * ((ray.direction * final_res.normal) * 2))).normalize();
+	return Ray(final_res.intersection_point + r * shadowRayEps, r);
+}
+
+// Parses the whitespace separated numbers in str into out. A first pass counts
+// the numbers so that out is allocated once.
+template <typename T>
+static void parse_numbers(const char *str, vector<T>& out)
+{
+	out.clear();
+	if (str == nullptr)
+		return;
+
+	const char *end = str + strlen(str);
+	size_t count = 0;
+	for (const char *p = str; p < end; )
+	{
+		while (p < end && isspace((unsigned char) *p))
+			p++;
+		if (p == end)
+			break;
+		count++;
+		while (p < end && !isspace((unsigned char) *p))
+			p++;
+	}
+	out.reserve(count);
+
+	for (const char *p = str; p < end; )
+	{
+		while (p < end && isspace((unsigned char) *p))
+			p++;
+		if (p == end)
+			break;
+		if (*p == '+')
+			p++;
+		T value = 0;
+		from_chars_result res = from_chars(p, end, value);
+		out.push_back(value);
+		p = res.ptr;
+		while (p < end && !isspace((unsigned char) *p))
+			p++;
+	}
+}
 
 // Parses XML file. 
-Scene::Scene(const char *xmlPath)
+Scene::Scene(const char *xmlPath, int numThreads, bool useCache, size_t outOfCoreBudget)
+    : numThreads(numThreads), numWorkers(0), outOfCoreBudget(outOfCoreBudget)
 {
 	const char *str;
 	XMLDocument xmlDoc;
 	XMLError eResult;
 	XMLElement *pElement;
 
+	// shapes read the vertex data through the global scene pointer while being built
+	pScene = this;
+
 	maxRecursionDepth = 1;
 	shadowRayEps = 0.001;
+	packetTracing = false;
+	wavefront = false;
+	imageFormat = IMAGE_FORMAT_AUTO;
+	aaMaxSamples = 1;
+	progressive = false;
+	saveGBuffer = false;
+	relight = false;
+	lightCutoff = 0;
+	cancelled = false;
+	aaThreshold = 8;
+
+	double start = currentSeconds();
+	if (useCache && SceneCache::load(*this, xmlPath))
+	{
+		stats.fromCache = true;
+		stats.parseSeconds = currentSeconds() - start;
+		selectShadingKernels();
+		return;
+	}
 
 	eResult = xmlDoc.LoadFile(xmlPath);
 
@@ -230,27 +969,13 @@ Scene::Scene(const char *xmlPath)
 
 	// Parse vertex data
 	pElement = pRoot->FirstChildElement("VertexData");
-	int cursor = 0;
-	Vector3f tmpPoint;
 	str = pElement->GetText();
-	while(str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
-		cursor++;
-	while(str[cursor] != '\0')
+	vector<double> coords;
+	parse_numbers(str, coords);
+	vertices.reserve(coords.size() / 3);
+	for (size_t i = 0; i + 2 < coords.size(); i += 3)
 	{
-		for(int cnt = 0 ; cnt < 3 ; cnt++)
-		{
-			if(cnt == 0)
-				tmpPoint.x = atof(str + cursor);
-			else if(cnt == 1)
-				tmpPoint.y = atof(str + cursor);
-			else
-				tmpPoint.z = atof(str + cursor);
-			while(str[cursor] != ' ' && str[cursor] != '\t' && str[cursor] != '\n')
-				cursor++; 
-			while(str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
-				cursor++;
-		}
-		vertices.push_back(tmpPoint);
+		vertices.push_back(Vector3f(coords[i], coords[i + 1], coords[i + 2]));
 	}
 
 	// Parse objects
@@ -274,7 +999,7 @@ Scene::Scene(const char *xmlPath)
 		objElement = pObject->FirstChildElement("Radius");
 		eResult = objElement->QueryFloatText(&R);
 
-		objects.push_back(new Sphere(id, matIndex, cIndex, R));
+		spheres.emplace_back(id, matIndex, cIndex, R);
 
 		pObject = pObject->NextSiblingElement("Sphere");
 	}
@@ -296,53 +1021,83 @@ Scene::Scene(const char *xmlPath)
 		str = objElement->GetText();
 		sscanf(str, "%d %d %d", &p1Index, &p2Index, &p3Index);
 
-		objects.push_back(new Triangle(id, matIndex, p1Index, p2Index, p3Index));
+		triangles.emplace_back(id, matIndex, p1Index, p2Index, p3Index);
 
 		pObject = pObject->NextSiblingElement("Triangle");
 	}
 
-	// Parse meshes
+	// Parse meshes. The element data is collected first, then the face lists are
+	// parsed in parallel, one task per mesh.
+	vector<XMLElement *> meshElements;
 	pObject = pElement->FirstChildElement("Mesh");
 	while(pObject != nullptr)
 	{
-		int id;
-		int matIndex;
-		int p1Index;
-		int p2Index;
-		int p3Index;
-		int cursor = 0;
-		int vertexOffset = 0;
-		vector<Triangle> faces;
+		meshElements.push_back(pObject);
+		pObject = pObject->NextSiblingElement("Mesh");
+	}
 
-		eResult = pObject->QueryIntAttribute("id", &id);
+	int numMeshes = meshElements.size();
+	vector<int> meshIds(numMeshes), meshMaterials(numMeshes), meshOffsets(numMeshes, 0);
+	vector<const char *> meshFaces(numMeshes);
+	for (int m = 0; m < numMeshes; m++)
+	{
+		pObject = meshElements[m];
+		eResult = pObject->QueryIntAttribute("id", &meshIds[m]);
 		objElement = pObject->FirstChildElement("Material");
-		eResult = objElement->QueryIntText(&matIndex);
+		eResult = objElement->QueryIntText(&meshMaterials[m]);
 		objElement = pObject->FirstChildElement("Faces");
-		objElement->QueryIntAttribute("vertexOffset", &vertexOffset);
-		str = objElement->GetText();
-		while(str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
-			cursor++;
-		while(str[cursor] != '\0')
+		objElement->QueryIntAttribute("vertexOffset", &meshOffsets[m]);
+		meshFaces[m] = objElement->GetText();
+	}
+
+	meshes.resize(numMeshes);
+	ThreadPool pool(numThreads);
+	pool.run(numMeshes, [&](int m, int worker) {
+		vector<int> indices;
+		parse_numbers(meshFaces[m], indices);
+
+		int vertexOffset = meshOffsets[m];
+		vector<TriangleData> faces;
+		faces.reserve(indices.size() / 3);
+		for (size_t i = 0; i + 2 < indices.size(); i += 3)
 		{
-			for(int cnt = 0 ; cnt < 3 ; cnt++)
-			{
-				if(cnt == 0)
-					p1Index = atoi(str + cursor) + vertexOffset;
-				else if(cnt == 1)
-					p2Index = atoi(str + cursor) + vertexOffset;
-				else
-					p3Index = atoi(str + cursor) + vertexOffset;
-				while(str[cursor] != ' ' && str[cursor] != '\t' && str[cursor] != '\n')
-					cursor++; 
-				while(str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
-					cursor++;
-			}
-			faces.push_back(*(new Triangle(-1, matIndex, p1Index, p2Index, p3Index)));
+			faces.emplace_back(vertices[indices[i] + vertexOffset - 1], vertices[indices[i + 1] + vertexOffset - 1], vertices[indices[i + 2] + vertexOffset - 1], meshMaterials[m]);
 		}
 
-		objects.push_back(new Mesh(id, matIndex, faces));
+		meshes[m] = Mesh(meshIds[m], meshMaterials[m], std::move(faces));
+	});
 
-		pObject = pObject->NextSiblingElement("Mesh");
+	// Parse mesh instances. The transformations are applied in the order they are
+	// listed, the material of the base mesh is used unless one is given.
+	pObject = pElement->FirstChildElement("MeshInstance");
+	while(pObject != nullptr)
+	{
+		int id;
+		int baseMeshId;
+		eResult = pObject->QueryIntAttribute("id", &id);
+		eResult = pObject->QueryIntAttribute("baseMeshId", &baseMeshId);
+
+		int meshIndex = -1;
+		for (int m = 0; m < numMeshes; m++)
+		{
+			if (meshIds[m] == baseMeshId)
+				meshIndex = m;
+		}
+		if (meshIndex == -1)
+		{
+			fprintf(stderr, "mesh instance %d: there is no mesh with id %d\n", id, baseMeshId);
+			pObject = pObject->NextSiblingElement("MeshInstance");
+			continue;
+		}
+
+		int matIndex = meshMaterials[meshIndex];
+		objElement = pObject->FirstChildElement("Material");
+		if (objElement != nullptr)
+			eResult = objElement->QueryIntText(&matIndex);
+
+		instances.emplace_back(id, matIndex, meshIndex, parseTransform(pObject));
+
+		pObject = pObject->NextSiblingElement("MeshInstance");
 	}
 
 	// Parse lights
@@ -371,5 +1126,94 @@ Scene::Scene(const char *xmlPath)
 
 		pLight = pLight->NextSiblingElement("PointLight");
 	}
+
+	stats.parseSeconds = currentSeconds() - start;
+	selectShadingKernels();
+
+	start = currentSeconds();
+	buildBVH();
+	stats.buildSeconds = currentSeconds() - start;
+
+	if (!useCache)
+		return;
+	bool saved = SceneCache::save(*this, xmlPath);
+	if (outOfCoreBudget == 0)
+		return;
+
+	// Out of core the faces come from the cache just written. The parsed scene is
+	// set aside meanwhile and kept, in memory, when the cache cannot be read back.
+	vector<Camera *> parsedCameras;
+	vector<PointLight *> parsedLights;
+	vector<Material *> parsedMaterials;
+	vector<Vector3f> parsedVertices;
+	vector<Sphere> parsedSpheres;
+	vector<Triangle> parsedTriangles;
+	vector<Mesh> parsedMeshes;
+	vector<MeshInstance> parsedInstances;
+	BVH parsedBVHs[4];
+	auto swap_parsed = [&]() {
+		cameras.swap(parsedCameras);
+		lights.swap(parsedLights);
+		materials.swap(parsedMaterials);
+		vertices.swap(parsedVertices);
+		spheres.swap(parsedSpheres);
+		triangles.swap(parsedTriangles);
+		meshes.swap(parsedMeshes);
+		instances.swap(parsedInstances);
+		std::swap(sphereBVH, parsedBVHs[0]);
+		std::swap(triangleBVH, parsedBVHs[1]);
+		std::swap(meshBVH, parsedBVHs[2]);
+		std::swap(instanceBVH, parsedBVHs[3]);
+	};
+
+	if (saved)
+	{
+		swap_parsed();
+		saved = SceneCache::load(*this, xmlPath);
+		if (!saved)
+			swap_parsed();
+	}
+	if (!saved)
+	{
+		fprintf(stderr, "the scene cache of %s could not be written or read back, the meshes stay in memory\n", xmlPath);
+		this->outOfCoreBudget = 0;
+		return;
+	}
+	for (Camera* cam : parsedCameras) delete cam;
+	for (Material* mat : parsedMaterials) delete mat;
+	for (PointLight* light : parsedLights) delete light;
+}
+
+template <typename T>
+static void refit_shapes_bvh(const vector<T>& shapes, BVH& bvh)
+{
+	vector<AABB> bounds(shapes.size());
+	for (size_t i = 0; i < shapes.size(); i++)
+	{
+		bounds[i] = shapes[i].getBoundingBox();
+	}
+	bvh.refit(bounds);
+}
+
+// Spheres and triangles do not move, so only the mesh and instance BVHs need new bounds
+void Scene::refitBVH(void)
+{
+	refit_shapes_bvh(meshes, meshBVH);
+	refit_shapes_bvh(instances, instanceBVH);
+}
+
+// Builds the BVHs of the meshes in parallel, then the top level BVH of each shape type.
+// Instances are bounded through the BVH of their base mesh, so they come last.
+void Scene::buildBVH(void)
+{
+	ThreadPool pool(numThreads);
+	pool.run(meshes.size(), [&](int m, int worker) {
+		meshes[m].buildBVH();
+	});
+
+	build_shapes_bvh(spheres, sphereBVH);
+	build_shapes_bvh(triangles, triangleBVH);
+	build_shapes_bvh(meshes, meshBVH);
+	build_shapes_bvh(instances, instanceBVH);
 }
 
@@ -7,16 +7,28 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <atomic>
 
 #include "Ray.h"
+#include "RayPacket.h"
+#include "BVH.h"
 #include "defs.h"
 #include "Image.h"
+#include "Stats.h"
+#include "Shape.h"
+#include "GBuffer.h"
+#include "ResidentSet.h"
+
+#define TILE_SIZE 16	// Width and height of the image tiles handed to the render threads
+#define MATERIAL_DIFFUSE 4	// Feature bits of a material, set when the coefficients are not zero
+#define MATERIAL_SPECULAR 2
+#define MATERIAL_MIRROR 1
+#define PROGRESSIVE_STEP 4	// Pixel spacing of the first progressive pass, must divide TILE_SIZE
 
 // Forward declarations to avoid cyclic references
 class Camera;
 class PointLight;
 class Material;
-class Shape;
 
 using namespace std;
 
@@ -29,20 +41,78 @@ public:
 	float shadowRayEps;				// ShadowRayEpsilon. You will need this one while generating shadow rays. 
 	Vector3f backgroundColor;		// Background color
 	Vector3f ambientLight;			// Ambient light radiance
+	int numThreads;					// Number of render threads
+	int numWorkers;					// Worker processes that render the tiles of a plain render, 0 renders them in threads
+	bool packetTracing;				// Trace primary rays in 2x2 SIMD packets
+	bool wavefront;					// Trace the rays of each tile stage by stage instead of recursively
+	ImageFormat imageFormat;		// Format of the output images
+	int aaMaxSamples;				// Sample budget per pixel of the adaptive anti-aliasing, 1 disables it
+	float aaThreshold;				// Color difference (0-255) above which pixels are supersampled
+	bool progressive;				// Render coarse to fine and write a preview after every pass
+	atomic<bool> cancelled;			// Set to stop a progressive render, may be set from a signal handler
+	vector<int> cameraIds;			// Ids of the cameras to render, empty for all
+	bool saveGBuffer;				// Store the primary hits of every camera next to its image
+	bool relight;					// Shade the stored primary hits instead of tracing primary rays
+	float lightCutoff;				// Lights that add less than this (0-255) to a hit are skipped, 0 keeps all of them
 
 	vector<Camera *> cameras;		// Vector holding all cameras
 	vector<PointLight *> lights;	// Vector holding all point lights
 	vector<Material *> materials;	// Vector holding all materials
 	vector<Vector3f> vertices;		// Vector holding all vertices (vertex data)
-	vector<Shape *> objects;		// Vector holding all shapes
+	vector<Sphere> spheres;			// Shapes, stored by value in one array per type
+	vector<Triangle> triangles;
+	vector<Mesh> meshes;
+	vector<MeshInstance> instances;	// Transformed copies of the meshes above, sharing their faces and BVHs
+	BVH sphereBVH;					// BVHs over the shape arrays, built after parsing
+	BVH triangleBVH;
+	BVH meshBVH;
+	BVH instanceBVH;
+	RenderStats stats;				// Timings and ray counts of the run
+	size_t outOfCoreBudget;			// Bytes of mesh faces kept in memory when they are paged from the scene cache, 0 loads them all
+	ResidentSet residentSet;		// Mapping of the scene cache the mesh faces are paged from when out of core
+	vector<int> materialFeatures;	// MATERIAL_* bits of every material, set at load time
+	vector<Vector3f> materialReflectance;	// Diffuse plus specular coefficients of every material
+	BVH lightBVH;					// BVH over the spheres in which each light reaches lightCutoff
 
-	Scene(const char *xmlPath);		// Constructor. Parses XML file and initializes vectors above. Implemented for you. 
+	Scene(const char *xmlPath, int numThreads = 1, bool useCache = false, size_t outOfCoreBudget = 0);	// Constructor. Parses XML file and initializes vectors above, meshes are parsed on numThreads threads. 
+																			// With useCache the binary scene cache next to the XML file is used and refreshed.
+																			// A non zero outOfCoreBudget pages the mesh faces from the cache, which it then requires.
 
 	void renderScene(void);			// Method to render scene, an image is created for each camera in the scene. You will implement this. 
+									// The cameras are rendered concurrently, their tiles share one thread pool.
+	void refitBVH(void);			// Refits the top level BVHs after meshes or instances moved
 
 private:
+	friend class Benchmark;	// Times the tracing kernels below, see bench/Benchmark.cpp
+
     // Write any other stuff here
 	Vector3f calculate_pixel_color(Ray ray, int recDepth);
+	Vector3f shade(const Ray& ray, const ReturnVal& final_res, int recDepth);
+	template <bool Diffuse, bool Specular, bool Mirror>
+	Vector3f shadeMaterial(const Ray& ray, const ReturnVal& final_res, int recDepth);	// shade() specialized for one material feature set
+	typedef Vector3f (Scene::*ShadeKernel)(const Ray& ray, const ReturnVal& final_res, int recDepth);
+	static const ShadeKernel shadeKernels[8];
+	void selectShadingKernels(void);
+	void tileBounds(const Camera* cam, int tile, int& row_begin, int& row_end, int& col_begin, int& col_end) const;
+	void renderTile(const Camera* cam, const ImageView& image, int tile);
+	void renderTileGBuffer(const Camera* cam, const ImageView& image, vector<GBufferPixel>& gbuffer, bool relit, int tile);
+	void renderTileProgressive(const Camera* cam, const ImageView& image, int tile, int step, bool first);
+	void fillPreview(const ImageView& image, int step) const;
+	void markEdges(const Camera* cam, const ConstImageView& image, vector<unsigned char>& edges, int tile) const;
+	void refineTile(const Camera* cam, const ImageView& image, const vector<unsigned char>& edges, int tile);
+	void renderTilePackets(const Camera* cam, const ImageView& image, int row_begin, int row_end, int col_begin, int col_end);
+	void renderTileWavefront(const Camera* cam, const ImageView& image, int row_begin, int row_end, int col_begin, int col_end);
+	void buildLightBVH(void);
+	void gatherLights(const ReturnVal& final_res, vector<int>& out) const;	// lights that may add at least lightCutoff to a hit, in scene order
+	Ray shadowRay(const ReturnVal& final_res, PointLight* plight, Vector3f& light_dir_normalized, float& tmax) const;
+	void addLightContribution(Vector3f& color, const Ray& ray, const ReturnVal& final_res, const Material& mat, PointLight* plight, const Vector3f& light_dir_normalized) const;
+	Ray reflectionRay(const Ray& ray, const ReturnVal& final_res) const;
+	ReturnVal intersect(const Ray& ray) const;	// closest hit among all objects
+	HitRecord closestHit(const Ray& ray) const;	// closest hit search of intersect, without the surface attributes
+	ReturnVal hitAttributes(const Ray& ray, const HitRecord& hit) const;
+	void intersectPacket(const RayPacket& packet, const Ray rays[PACKET_SIZE], ReturnVal results[PACKET_SIZE]) const;
+	bool occluded(const Ray& ray, float tmax) const;	// whether any object is hit before tmax
+	void buildBVH(void);
 };
 
 #endif
@@ -0,0 +1,586 @@
+#include "SceneCache.h"
+#include "Scene.h"
+#include "Camera.h"
+#include "Light.h"
+#include "Material.h"
+#include "Shape.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC 0x43535452	// "RTSC"
+#define CACHE_VERSION 5
+#define CHECK_CHUNK (4 << 20)	// Bytes of the mapped cache read between releases of its pages when loading out of core
+#define MESH_ALIGNMENT 4096	// Mesh faces and BVHs start on a page, so they can be mapped and paged in place
+
+// Identifies the XML file the cache was made from and the layout of the stored records
+typedef struct CacheHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int triangleDataSize;
+    unsigned int bvhNodeSize;
+    long long xmlMtime;
+    long long xmlMtimeNsec;
+    long long xmlSize;
+    unsigned long long xmlHash;
+    unsigned long long payloadHash;	// Hash of everything after the header
+} CacheHeader;
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+// FNV-1a over 8 byte words, the bytes after the last full word are hashed one by one
+static unsigned long long hash_bytes(unsigned long long hash, const char *data, size_t size)
+{
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, data + i, 8);
+        hash ^= word;
+        hash *= FNV_PRIME;
+    }
+    for (; i < size; i++)
+    {
+        hash ^= (unsigned char) data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Hands the whole pages of a read range of the mapping back to the kernel, so
+// checking a cache that is loaded out of core does not keep all of it in memory
+static void release_pages(const void *data, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = ((size_t) data + page - 1) / page * page;
+    size_t end = ((size_t) data + size) / page * page;
+    if (end > begin)
+        madvise((void *) begin, end - begin, MADV_DONTNEED);
+}
+
+// Hash of the payload, the cache without its header. CHECK_CHUNK is a multiple of 8,
+// so hashing in chunks gives the same result as hashing the payload at once
+static unsigned long long hash_payload(const char *data, size_t size, bool release)
+{
+    unsigned long long hash = FNV_OFFSET;
+    for (size_t pos = sizeof(CacheHeader); pos < size; pos += CHECK_CHUNK)
+    {
+        size_t n = std::min((size_t) CHECK_CHUNK, size - pos);
+        hash = hash_bytes(hash, data + pos, n);
+        if (release)
+            release_pages(data + pos, n);
+    }
+    return hash;
+}
+
+// FNV-1a hash of the whole file, 0 if it cannot be read
+static unsigned long long hash_file(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+        return 0;
+
+    unsigned long long hash = FNV_OFFSET;
+    unsigned char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            hash ^= buffer[i];
+            hash *= FNV_PRIME;
+        }
+    }
+    fclose(file);
+    return hash;
+}
+
+static bool make_header(const char *xmlPath, CacheHeader& header)
+{
+    struct stat st;
+    if (stat(xmlPath, &st) != 0)
+        return false;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.triangleDataSize = sizeof(TriangleData);
+    header.bvhNodeSize = sizeof(BVHNode);
+    header.xmlMtime = st.st_mtim.tv_sec;
+    header.xmlMtimeNsec = st.st_mtim.tv_nsec;
+    header.xmlSize = st.st_size;
+    return true;
+}
+
+// Appends plain values and arrays to the cache image
+typedef struct CacheWriter
+{
+    vector<char> buffer;
+
+    template <typename T>
+    void put(const T& value)
+    {
+        const char *bytes = (const char *) &value;
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    // arrays start on a 64 byte boundary so the loader can copy whole cache lines
+    template <typename T>
+    void putArray(const vector<T>& values, size_t alignment = 64)
+    {
+        put((long long) values.size());
+        buffer.resize((buffer.size() + alignment - 1) / alignment * alignment, 0);
+        const char *bytes = (const char *) values.data();
+        buffer.insert(buffer.end(), bytes, bytes + values.size() * sizeof(T));
+    }
+} CacheWriter;
+
+// Reads back what CacheWriter wrote, every read is bounds checked
+typedef struct CacheReader
+{
+    const char *data;
+    size_t size;
+    size_t pos;
+    bool ok;
+
+    template <typename T>
+    T get()
+    {
+        T value;
+        if (pos + sizeof(T) > size)
+        {
+            ok = false;
+            memset((void *) &value, 0, sizeof(T));
+            return value;
+        }
+        memcpy((void *) &value, data + pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    template <typename T>
+    void getArray(vector<T>& values, size_t alignment = 64)
+    {
+        const T *mapped;
+        long long count;
+        mapArray(mapped, count, alignment);
+        if (!ok)
+            return;
+        values.resize(count);
+        memcpy((void *) values.data(), mapped, count * sizeof(T));
+    }
+
+    // Skips over an array and points to it in place instead of copying it
+    template <typename T>
+    void mapArray(const T *& values, long long& count, size_t alignment = 64)
+    {
+        count = get<long long>();
+        pos = (pos + alignment - 1) / alignment * alignment;
+        if (!ok || count < 0 || pos + count * sizeof(T) > size)
+        {
+            ok = false;
+            count = 0;
+            return;
+        }
+        values = (const T *) (data + pos);
+        pos += count * sizeof(T);
+    }
+} CacheReader;
+
+static void put_bvh(CacheWriter& writer, const BVH& bvh, size_t alignment = 64)
+{
+    writer.putArray(bvh.nodes, alignment);
+    writer.putArray(bvh.primIndices, alignment);
+}
+
+// Whether valid(values[i], i) holds for every value of an array. With release the
+// pages read are handed back every CHECK_CHUNK bytes.
+template <typename T, typename F>
+static bool check_array(const T *values, long long count, bool release, F valid)
+{
+    const long long chunk = CHECK_CHUNK / sizeof(T);
+    for (long long first = 0; first < count; first += chunk)
+    {
+        long long n = std::min(chunk, count - first);
+        for (long long i = first; i < first + n; i++)
+        {
+            if (!valid(values[i], i))
+                return false;
+        }
+        if (release)
+            release_pages(values + first, n * sizeof(T));
+    }
+    return true;
+}
+
+// Whether every child, leaf range and primitive index of a BVH lies inside its arrays.
+// Children come after their parent, so the traversal cannot loop.
+static bool valid_bvh(const BVHNode *nodes, long long numNodes, const int *primIndices, long long numPrims, long long numObjects, bool release)
+{
+    return check_array(nodes, numNodes, release, [&](const BVHNode& node, long long n) {
+               return (node.count > 0) ? (node.offset >= 0 && node.offset <= numPrims - node.count)
+                                       : (node.count == 0 && n + 1 < node.offset && node.offset < numNodes);
+           }) &&
+           check_array(primIndices, numPrims, release, [&](int index, long long) {
+               return index >= 0 && index < numObjects;
+           });
+}
+
+// numObjects is the size of the array the primitive indices refer to
+static void get_bvh(CacheReader& reader, BVH& bvh, long long numObjects, size_t alignment = 64)
+{
+    reader.getArray(bvh.nodes, alignment);
+    reader.getArray(bvh.primIndices, alignment);
+    if (reader.ok && !valid_bvh(bvh.nodes.data(), bvh.nodes.size(), bvh.primIndices.data(), bvh.primIndices.size(), numObjects, false))
+        reader.ok = false;
+}
+
+// Arrays of a mesh left in the mapping, registered with the resident set once the whole cache is read
+typedef struct MappedMesh
+{
+    const BVHNode *nodes;
+    long long numNodes;
+    const int *primIndices;
+    long long numPrims;
+} MappedMesh;
+
+string SceneCache::cachePath(const char *xmlPath)
+{
+    return string(xmlPath) + ".cache";
+}
+
+bool SceneCache::save(const Scene& scene, const char *xmlPath)
+{
+    CacheHeader header;
+    if (!make_header(xmlPath, header))
+        return false;
+    header.xmlHash = hash_file(xmlPath);
+
+    CacheWriter writer;
+    writer.put(header);
+
+    writer.put(scene.maxRecursionDepth);
+    writer.put(scene.intTestEps);
+    writer.put(scene.shadowRayEps);
+    writer.put(scene.backgroundColor);
+    writer.put(scene.ambientLight);
+
+    writer.put((int) scene.cameras.size());
+    for (const Camera* cam : scene.cameras)
+    {
+        writer.put(cam->id);
+        writer.put(cam->imageName);
+        writer.put(cam->pos);
+        writer.put(cam->gaze);
+        writer.put(cam->up);
+        writer.put(cam->imgPlane);
+    }
+
+    writer.put((int) scene.materials.size());
+    for (const Material* mat : scene.materials)
+    {
+        writer.put(mat->id);
+        writer.put(mat->phongExp);
+        writer.put(mat->ambientRef);
+        writer.put(mat->diffuseRef);
+        writer.put(mat->specularRef);
+        writer.put(mat->mirrorRef);
+    }
+
+    writer.put((int) scene.lights.size());
+    for (const PointLight* light : scene.lights)
+    {
+        writer.put(light->position);
+        writer.put(light->intensity);
+    }
+
+    writer.putArray(scene.vertices);
+
+    writer.put((int) scene.spheres.size());
+    for (const Sphere& sphere : scene.spheres)
+    {
+        writer.put(sphere.id);
+        writer.put(sphere.matIndex);
+        writer.put(sphere.cIndex);
+        writer.put(sphere.R);
+    }
+
+    writer.put((int) scene.triangles.size());
+    for (const Triangle& triangle : scene.triangles)
+    {
+        writer.put(triangle.id);
+        writer.put(triangle.matIndex);
+        writer.put(triangle.p1Index);
+        writer.put(triangle.p2Index);
+        writer.put(triangle.p3Index);
+    }
+
+    writer.put((int) scene.meshes.size());
+    for (const Mesh& mesh : scene.meshes)
+    {
+        writer.put(mesh.id);
+        writer.put(mesh.matIndex);
+        writer.putArray(mesh.faces, MESH_ALIGNMENT);
+        put_bvh(writer, mesh.bvh, MESH_ALIGNMENT);
+    }
+
+    writer.put((int) scene.instances.size());
+    for (const MeshInstance& instance : scene.instances)
+    {
+        writer.put(instance.id);
+        writer.put(instance.matIndex);
+        writer.put(instance.meshIndex);
+        writer.put(instance.objectToWorld);
+    }
+
+    put_bvh(writer, scene.sphereBVH);
+    put_bvh(writer, scene.triangleBVH);
+    put_bvh(writer, scene.meshBVH);
+    put_bvh(writer, scene.instanceBVH);
+
+    header.payloadHash = hash_payload(writer.buffer.data(), writer.buffer.size(), false);
+    memcpy(writer.buffer.data(), &header, sizeof(header));
+
+    // write to a temporary file and rename it, so readers never see a partial cache
+    string path = cachePath(xmlPath);
+    string tmpPath = path + ".tmp" + to_string(getpid());
+    FILE *output = fopen(tmpPath.c_str(), "wb");
+    if (output == nullptr)
+        return false;
+    bool written = fwrite(writer.buffer.data(), 1, writer.buffer.size(), output) == writer.buffer.size();
+    written = (fclose(output) == 0) && written;
+    if (!written || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+void SceneCache::clear(Scene& scene)
+{
+    for (Camera* cam : scene.cameras) delete cam;
+    for (Material* mat : scene.materials) delete mat;
+    for (PointLight* light : scene.lights) delete light;
+    scene.cameras.clear();
+    scene.materials.clear();
+    scene.lights.clear();
+    scene.vertices.clear();
+    scene.spheres.clear();
+    scene.triangles.clear();
+    scene.meshes.clear();
+    scene.instances.clear();
+    scene.sphereBVH = BVH();
+    scene.triangleBVH = BVH();
+    scene.meshBVH = BVH();
+    scene.instanceBVH = BVH();
+}
+
+/* With Scene::outOfCoreBudget set the mesh faces and BVHs are not copied: the meshes
+point into the mapping, which is handed to Scene::residentSet to bound what stays in memory. */
+bool SceneCache::load(Scene& scene, const char *xmlPath)
+{
+    bool outOfCore = scene.outOfCoreBudget > 0;
+    vector<MappedMesh> mapped;
+    CacheHeader expected;
+    if (!make_header(xmlPath, expected))
+        return false;
+
+    string path = cachePath(xmlPath);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(CacheHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    CacheReader reader = {(const char *) mapping, (size_t) st.st_size, 0, true};
+    CacheHeader header = reader.get<CacheHeader>();
+    bool valid = header.magic == expected.magic && header.version == expected.version &&
+                 header.triangleDataSize == expected.triangleDataSize && header.bvhNodeSize == expected.bvhNodeSize &&
+                 header.xmlMtime == expected.xmlMtime && header.xmlMtimeNsec == expected.xmlMtimeNsec &&
+                 header.xmlSize == expected.xmlSize;
+    // the hashes are only computed once the cheap checks pass, out of core the
+    // payload is read through without keeping it in memory
+    if (!valid || header.xmlHash != hash_file(xmlPath) ||
+        header.payloadHash != hash_payload(reader.data, reader.size, outOfCore))
+    {
+        munmap(mapping, st.st_size);
+        return false;
+    }
+
+    scene.maxRecursionDepth = reader.get<int>();
+    scene.intTestEps = reader.get<float>();
+    scene.shadowRayEps = reader.get<float>();
+    scene.backgroundColor = reader.get<Vector3f>();
+    scene.ambientLight = reader.get<Vector3f>();
+
+    int numCameras = reader.get<int>();
+    for (int i = 0; i < numCameras && reader.ok; i++)
+    {
+        int id = reader.get<int>();
+        char imageName[sizeof(Camera::imageName)];
+        if (reader.pos + sizeof(imageName) > reader.size)
+        {
+            reader.ok = false;
+            break;
+        }
+        memcpy(imageName, reader.data + reader.pos, sizeof(imageName));
+        reader.pos += sizeof(imageName);
+        imageName[sizeof(imageName) - 1] = '\0';
+        Vector3f pos = reader.get<Vector3f>();
+        Vector3f gaze = reader.get<Vector3f>();
+        Vector3f up = reader.get<Vector3f>();
+        ImagePlane imgPlane = reader.get<ImagePlane>();
+        if (reader.ok)
+            scene.cameras.push_back(new Camera(id, imageName, pos, gaze, up, imgPlane));
+    }
+
+    int numMaterials = reader.get<int>();
+    for (int i = 0; i < numMaterials && reader.ok; i++)
+    {
+        Material* mat = new Material();
+        mat->id = reader.get<int>();
+        mat->phongExp = reader.get<int>();
+        mat->ambientRef = reader.get<Vector3f>();
+        mat->diffuseRef = reader.get<Vector3f>();
+        mat->specularRef = reader.get<Vector3f>();
+        mat->mirrorRef = reader.get<Vector3f>();
+        scene.materials.push_back(mat);
+    }
+
+    int numLights = reader.get<int>();
+    for (int i = 0; i < numLights && reader.ok; i++)
+    {
+        Vector3f position = reader.get<Vector3f>();
+        Vector3f intensity = reader.get<Vector3f>();
+        scene.lights.push_back(new PointLight(position, intensity));
+    }
+
+    reader.getArray(scene.vertices);
+
+    // indices of vertices and materials start at 1
+    auto vertex_ok = [&](int index) { return index >= 1 && index <= (int) scene.vertices.size(); };
+    auto material_ok = [&](int index) { return index >= 1 && index <= (int) scene.materials.size(); };
+
+    int numSpheres = reader.get<int>();
+    for (int i = 0; i < numSpheres && reader.ok; i++)
+    {
+        int id = reader.get<int>();
+        int matIndex = reader.get<int>();
+        int cIndex = reader.get<int>();
+        float R = reader.get<float>();
+        if (!vertex_ok(cIndex) || !material_ok(matIndex))
+            reader.ok = false;
+        if (reader.ok)
+            scene.spheres.emplace_back(id, matIndex, cIndex, R);
+    }
+
+    int numTriangles = reader.get<int>();
+    for (int i = 0; i < numTriangles && reader.ok; i++)
+    {
+        int id = reader.get<int>();
+        int matIndex = reader.get<int>();
+        int p1Index = reader.get<int>();
+        int p2Index = reader.get<int>();
+        int p3Index = reader.get<int>();
+        if (!vertex_ok(p1Index) || !vertex_ok(p2Index) || !vertex_ok(p3Index) || !material_ok(matIndex))
+            reader.ok = false;
+        if (reader.ok)
+            scene.triangles.emplace_back(id, matIndex, p1Index, p2Index, p3Index);
+    }
+
+    int numMeshes = reader.get<int>();
+    for (int i = 0; i < numMeshes && reader.ok; i++)
+    {
+        scene.meshes.emplace_back();
+        Mesh& mesh = scene.meshes.back();
+        mesh.id = reader.get<int>();
+        mesh.matIndex = reader.get<int>();
+        if (!material_ok(mesh.matIndex))
+            reader.ok = false;
+        const TriangleData *faces;
+        long long numFaces;
+        if (outOfCore)
+        {
+            // the mapped arrays are checked like the copied ones, releasing the pages read
+            reader.mapArray(mesh.mappedFaces, numFaces, MESH_ALIGNMENT);
+            mesh.numMappedFaces = numFaces;
+            faces = mesh.mappedFaces;
+            MappedMesh m;
+            reader.mapArray(m.nodes, m.numNodes, MESH_ALIGNMENT);
+            reader.mapArray(m.primIndices, m.numPrims, MESH_ALIGNMENT);
+            if (reader.ok && !valid_bvh(m.nodes, m.numNodes, m.primIndices, m.numPrims, numFaces, true))
+                reader.ok = false;
+            mapped.push_back(m);
+        }
+        else
+        {
+            reader.getArray(mesh.faces, MESH_ALIGNMENT);
+            get_bvh(reader, mesh.bvh, mesh.faces.size(), MESH_ALIGNMENT);
+            faces = mesh.faces.data();
+            numFaces = mesh.faces.size();
+        }
+        if (reader.ok && !check_array(faces, numFaces, outOfCore, [&](const TriangleData& face, long long) { return material_ok(face.matIndex); }))
+            reader.ok = false;
+    }
+
+    int numInstances = reader.get<int>();
+    for (int i = 0; i < numInstances && reader.ok; i++)
+    {
+        int id = reader.get<int>();
+        int matIndex = reader.get<int>();
+        int meshIndex = reader.get<int>();
+        Transform objectToWorld = reader.get<Transform>();
+        if (meshIndex < 0 || meshIndex >= (int) scene.meshes.size() || !material_ok(matIndex))
+            reader.ok = false;
+        if (reader.ok)
+            scene.instances.emplace_back(id, matIndex, meshIndex, objectToWorld);
+    }
+
+    get_bvh(reader, scene.sphereBVH, scene.spheres.size());
+    get_bvh(reader, scene.triangleBVH, scene.triangles.size());
+    get_bvh(reader, scene.meshBVH, scene.meshes.size());
+    get_bvh(reader, scene.instanceBVH, scene.instances.size());
+
+    if (!reader.ok || reader.pos != reader.size)
+    {
+        // a damaged cache leaves a half built scene behind, start over from the XML
+        munmap(mapping, st.st_size);
+        clear(scene);
+        return false;
+    }
+
+    // out of core the mapping stays, the faces and mesh BVHs are paged from it in clusters
+    if (!outOfCore)
+    {
+        munmap(mapping, st.st_size);
+        return true;
+    }
+    scene.residentSet.attach(mapping, st.st_size, scene.outOfCoreBudget);
+    const char *base = (const char *) mapping;
+    for (size_t i = 0; i < scene.meshes.size(); i++)
+    {
+        Mesh& mesh = scene.meshes[i];
+        const MappedMesh& m = mapped[i];
+        mesh.residentSet = &scene.residentSet;
+        mesh.firstCluster = scene.residentSet.addRegion((const char *) mesh.mappedFaces - base, (size_t) mesh.numMappedFaces * sizeof(TriangleData));
+        int firstNodeCluster = scene.residentSet.addRegion((const char *) m.nodes - base, (size_t) m.numNodes * sizeof(BVHNode));
+        int firstPrimCluster = scene.residentSet.addRegion((const char *) m.primIndices - base, (size_t) m.numPrims * sizeof(int));
+        mesh.bvh.map(m.nodes, m.numNodes, m.primIndices, m.numPrims, &scene.residentSet, firstNodeCluster, firstPrimCluster);
+    }
+    return true;
+}
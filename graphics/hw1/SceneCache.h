@@ -0,0 +1,26 @@
+#ifndef _SCENECACHE_H_
+#define _SCENECACHE_H_
+
+#include <string>
+
+using namespace std;
+
+class Scene;
+
+// Binary cache of a parsed scene. It is written next to the XML file as <xml>.cache
+// and holds everything Scene::Scene produces, including the built BVHs, so a repeat
+// run maps it into memory instead of parsing the XML. The cache is only used while
+// the modification time, size and hash of the XML file match the ones it was made from,
+// the hash of its payload matches the header and every index it holds is in range.
+class SceneCache
+{
+public:
+	static bool load(Scene& scene, const char *xmlPath);		// Fills scene from the cache, false if there is no valid cache
+	static bool save(const Scene& scene, const char *xmlPath);	// Writes the cache of a freshly parsed scene
+	static void clear(Scene& scene);							// Drops everything load fills in
+
+private:
+	static string cachePath(const char *xmlPath);
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "Shape.h"
 #include "Scene.h"
+#include "Stats.h"
+#include "VectorBatch.h"
 #include <cstdio>
 #include <algorithm>
 
@@ -12,6 +14,15 @@ Shape::Shape(int id, int matIndex)
 {
 }
 
+// Largest float that is not greater than d, so that (float) x > d holds exactly when x > float_below(d)
+static float float_below(double d)
+{
+    float f = (float) d;
+    if ((double) f > d)
+        f = nextafterf(f, -std::numeric_limits<float>::infinity());
+    return f;
+}
+
 Sphere::Sphere(void)
 {}
 
@@ -23,20 +34,91 @@ Sphere::Sphere(int id, int matIndex, int cIndex, float R)
 }
 
 /* Sphere-ray intersection routine. You will implement this. 
-Note that ReturnVal structure should hold the information related to the intersection point, e.g., coordinate of that point, normal at that point etc. 
-You should to declare the variables in ReturnVal structure you think you will need. It is in defs.h file. */
-ReturnVal Sphere::intersect(const Ray & ray) const
+Only the ray parameter is computed here, the rest of the intersection information is filled in by hitAttributes for the closest hit. */
+bool Sphere::intersectHit(const Ray & ray, HitRecord & hit) const
 {
-	/***********************************************
-     *                                             *
-	 * TODO: Implement this function               *
-     *                                             *
-     ***********************************************
-	 */
+    float t;
+    if (!this->hit(ray, t) || !(t < hit.t))
+        return false;
 
-    float infty = std::numeric_limits<float>::infinity();
-    float eps = pScene->intTestEps;
+    hit.t = t;
+    return true;
+}
+
+ReturnVal Sphere::hitAttributes(const Ray & ray, const HitRecord & hit) const
+{
     ReturnVal result;
+    Vector3f center = pScene->vertices[cIndex - 1];
+
+    result.intersects = true;
+    result.t = hit.t;
+    result.intersection_point = ray.origin + (ray.direction * result.t);
+    result.material_index = matIndex;
+    result.normal = (result.intersection_point - center) / R;
+    result.shape_type = 1; // 1 for sphere, 2 for triangle
+    result.shape_id = id;
+    //result.obj = this;
+    return result;
+}
+
+// Any-hit test for shadow rays, only the ray parameter is computed
+bool Sphere::occluded(const Ray & ray, float tmax) const
+{
+    float t;
+    return hit(ray, t) && t < tmax;
+}
+
+// Packet version of intersectHit, every lane repeats the operations of hit() in the same order
+int Sphere::intersectPacket(const RayPacket & packet, HitRecord hits[PACKET_SIZE]) const
+{
+    float eps = pScene->intTestEps;
+    Vector3f center = pScene->vertices[cIndex - 1];
+
+    vfloat4 dx = vfloat4::load(packet.dx), dy = vfloat4::load(packet.dy), dz = vfloat4::load(packet.dz);
+    vfloat4 ecx = vfloat4::load(packet.ox) - vfloat4(center.x);
+    vfloat4 ecy = vfloat4::load(packet.oy) - vfloat4(center.y);
+    vfloat4 ecz = vfloat4::load(packet.oz) - vfloat4(center.z);
+
+    vfloat4 a = dx * dx + dy * dy + dz * dz;
+    vfloat4 b = (dx * ecx + dy * ecy + dz * ecz) * vfloat4(2.0f);
+    vfloat4 c = (ecx * ecx + ecy * ecy + ecz * ecz) - vfloat4(R*R);
+    vfloat4 discriminant = b * b - vfloat4(4.0f) * a * c;
+    vfloat4 neg_eps(-eps);
+    vbool4 valid = not_less(discriminant, neg_eps);
+    if (valid.mask() == 0)
+        return 0;
+
+    vfloat4 sqrt_disc = vsqrt(discriminant);
+    vfloat4 two_a = vfloat4(2.0f) * a;
+    vfloat4 t0 = (-b - sqrt_disc) / two_a;
+    vfloat4 t1 = (-b + sqrt_disc) / two_a;
+    vbool4 swap = t0 > t1;
+    vfloat4 t_lo = select(swap, t1, t0);
+    vfloat4 t_hi = select(swap, t0, t1);
+    vfloat4 t = select(t_lo < neg_eps, t_hi, t_lo);
+    valid = valid & not_less(t, neg_eps);
+
+    alignas(16) float tmax[PACKET_SIZE];
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+        tmax[lane] = hits[lane].t;
+    int mask = (valid & (t < vfloat4::load(tmax))).mask();
+    if (mask == 0)
+        return 0;
+
+    alignas(16) float ts[PACKET_SIZE];
+    t.store(ts);
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+    {
+        if (mask & (1 << lane))
+            hits[lane].t = ts[lane];
+    }
+    return mask;
+}
+
+// Computes the ray parameter of the nearest intersection in front of the ray origin
+bool Sphere::hit(const Ray & ray, float & t) const
+{
+    float eps = pScene->intTestEps;
 
     Vector3f center = pScene->vertices[cIndex - 1];
 
@@ -48,97 +130,65 @@ ReturnVal Sphere::intersect(const Ray & ray) const
     float discriminant = b * b - 4 * a * c;
     if (discriminant < -eps)
     {
-        result.intersects = false;
-        result.t = infty;
-        return result;
+        return false;
     }
 
-    else
+    float sqrt_disc = sqrt(discriminant);
+    t0 = (-b - sqrt_disc) / (2.0 * a);
+    t1 = (-b + sqrt_disc) / (2.0 * a);
+
+    if (t0 > t1) 
     {
-        float sqrt_disc = sqrt(discriminant);
-        t0 = (-b - sqrt_disc) / (2.0 * a);
-        t1 = (-b + sqrt_disc) / (2.0 * a);
-        
-        if (t0 > t1) 
-        {
-            std::swap(t0, t1);
-        }
+        std::swap(t0, t1);
+    }
 
+    if (t0 < -eps)
+    {
+        t0 = t1;
         if (t0 < -eps)
         {
-            t0 = t1;
-            if (t0 < -eps)
-            {
-                result.intersects = false;
-                result.t = infty;
-                return result;
-            }
+            return false;
         }
-
-        result.intersects = true;
-        result.t = t0;
-        result.intersection_point = ray.origin + (ray.direction * result.t);
-        result.material_index = matIndex;
-        result.normal = (result.intersection_point - center) / R;
-        result.shape_type = 1; // 1 for sphere, 2 for triangle
-        result.shape_id = id;
-        //result.obj = this;
-        return result;
     }
 
+    t = t0;
+    return true;
 }
 
-Triangle::Triangle(void)
+AABB Sphere::getBoundingBox() const
+{
+    Vector3f center = pScene->vertices[cIndex - 1];
+    AABB box;
+    box.expand(center - Vector3f(R, R, R));
+    box.expand(center + Vector3f(R, R, R));
+    box.pad();
+    return box;
+}
+
+TriangleData::TriangleData(void)
 {}
 
-/* Constructor for triangle. You will implement this. */
-Triangle::Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index)
-    : Shape(id, matIndex), p1Index(p1Index), p2Index(p2Index), p3Index(p3Index)
+TriangleData::TriangleData(const Vector3f& vertex1, const Vector3f& vertex2, const Vector3f& vertex3, int matIndex)
+    : vertex1(vertex1), edge1(vertex1 - vertex2), edge2(vertex1 - vertex3), matIndex(matIndex)
 {
-    /*
-    this->vertex1 = pScene->vertices[p1Index - 1];
-    this->vertex2 = pScene->vertices[p2Index - 1];
-    this->vertex3 = pScene->vertices[p3Index - 1];   
     this->normal = (vertex3 - vertex2).cross_product(vertex1 - vertex2).normalize();
-    */
 }
 
-/* Triangle-ray intersection routine. You will implement this. 
-Note that ReturnVal structure should hold the information related to the intersection point, e.g., coordinate of that point, normal at that point etc. 
-You should to declare the variables in ReturnVal structure you think you will need. It is in defs.h file. */
-ReturnVal Triangle::intersect(const Ray & ray) const
+// Cramer's rule solution of the ray-plane system, rejects back facing triangles
+bool TriangleData::hit(const Ray & ray, float eps, float & t, float & beta, float & gamma) const
 {
-	/***********************************************
-     *                                             *
-	 * TODO: Implement this function               *
-     *                                             *
-     ***********************************************
-	 */
-
-    float infty = std::numeric_limits<float>::infinity();
-    float eps = pScene->intTestEps;
-
-    Vector3f vertex1 = pScene->vertices[p1Index - 1];
-    Vector3f vertex2 = pScene->vertices[p2Index - 1];
-    Vector3f vertex3 = pScene->vertices[p3Index - 1];   
-    Vector3f normal = (vertex3 - vertex2).cross_product(vertex1 - vertex2).normalize();
-
-    ReturnVal result;
-    result.t = infty;
-
     float normal_dot_ray_dir = normal * ray.direction;
-    if (normal_dot_ray_dir > .0 || fabs(normal * ray.direction) < eps)
+    if (normal_dot_ray_dir > .0 || fabs(normal_dot_ray_dir) < eps)
     {
-        result.intersects = false;
-        return result;
+        return false;
     }
 
-    float a = vertex1.x - vertex2.x;
-    float b = vertex1.y - vertex2.y;
-    float c = vertex1.z - vertex2.z;
-    float d = vertex1.x - vertex3.x;
-    float e = vertex1.y - vertex3.y;
-    float f = vertex1.z - vertex3.z;
+    float a = edge1.x;
+    float b = edge1.y;
+    float c = edge1.z;
+    float d = edge2.x;
+    float e = edge2.y;
+    float f = edge2.z;
     float g = ray.direction.x;
     float h = ray.direction.y;
     float i = ray.direction.z;
@@ -154,51 +204,166 @@ ReturnVal Triangle::intersect(const Ray & ray) const
 
     float detA = a * ei_minus_hf + b * gf_minus_di + c * dh_minus_eg;
 
-    float beta = (j * ei_minus_hf + k * gf_minus_di + l * dh_minus_eg) / detA;
+    beta = (j * ei_minus_hf + k * gf_minus_di + l * dh_minus_eg) / detA;
 
     if (beta < -eps)
     {
-        result.intersects = false;
-        return result;
+        return false;
     }
 
-    float gamma = (i * ak_minus_jb + h * jc_minus_al + g * bl_minus_kc) / detA;
+    gamma = (i * ak_minus_jb + h * jc_minus_al + g * bl_minus_kc) / detA;
 
     if (gamma < -eps || (gamma + beta) > (1.0 + eps))
     {
-        result.intersects = false;
-        return result;
+        return false;
     }
 
-    float t = (-1) * (f * ak_minus_jb + e * jc_minus_al + d * bl_minus_kc) / detA;
+    t = (-1) * (f * ak_minus_jb + e * jc_minus_al + d * bl_minus_kc) / detA;
 
     if (t <= -eps) 
     {
-        result.intersects = false;
-        return result;
+        return false;
     }
-    else
+    return true;
+}
+
+// Packet version of hit, every lane repeats the scalar operations in the same order
+int TriangleData::hitPacket(const RayPacket & packet, float eps, vfloat4 & t, vfloat4 & beta, vfloat4 & gamma) const
+{
+    vfloat4 g = vfloat4::load(packet.dx);
+    vfloat4 h = vfloat4::load(packet.dy);
+    vfloat4 i = vfloat4::load(packet.dz);
+    vfloat4 zero(0.0f);
+    vfloat4 eps4(eps);
+    vfloat4 neg_eps(-eps);
+
+    vfloat4 normal_dot_ray_dir = vfloat4(normal.x) * g + vfloat4(normal.y) * h + vfloat4(normal.z) * i;
+    vbool4 valid = not_greater(normal_dot_ray_dir, zero) & not_less(vabs(normal_dot_ray_dir), eps4);
+    if (valid.mask() == 0)
+        return 0;
+
+    vfloat4 a(edge1.x), b(edge1.y), c(edge1.z);
+    vfloat4 d(edge2.x), e(edge2.y), f(edge2.z);
+    vfloat4 j = vfloat4(vertex1.x) - vfloat4::load(packet.ox);
+    vfloat4 k = vfloat4(vertex1.y) - vfloat4::load(packet.oy);
+    vfloat4 l = vfloat4(vertex1.z) - vfloat4::load(packet.oz);
+    vfloat4 ei_minus_hf = e * i - h * f;
+    vfloat4 gf_minus_di = g * f - d * i;
+    vfloat4 dh_minus_eg = d * h - e * g;
+    vfloat4 ak_minus_jb = a * k - j * b;
+    vfloat4 jc_minus_al = j * c - a * l;
+    vfloat4 bl_minus_kc = b * l - k * c;
+
+    vfloat4 detA = a * ei_minus_hf + b * gf_minus_di + c * dh_minus_eg;
+
+    beta = (j * ei_minus_hf + k * gf_minus_di + l * dh_minus_eg) / detA;
+    gamma = (i * ak_minus_jb + h * jc_minus_al + g * bl_minus_kc) / detA;
+    t = (-(f * ak_minus_jb + e * jc_minus_al + d * bl_minus_kc)) / detA;
+
+    valid = valid & not_less(beta, neg_eps) & not_less(gamma, neg_eps)
+                  & not_greater(gamma + beta, vfloat4(float_below(1.0 + eps))) & not_less_equal(t, neg_eps);
+    return valid.mask();
+}
+
+AABB TriangleData::getBoundingBox() const
+{
+    AABB box;
+    box.expand(vertex1);
+    box.expand(vertex1 - edge1);
+    box.expand(vertex1 - edge2);
+    box.pad();
+    return box;
+}
+
+Triangle::Triangle(void)
+{}
+
+/* Constructor for triangle. You will implement this. */
+Triangle::Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index)
+    : Shape(id, matIndex), p1Index(p1Index), p2Index(p2Index), p3Index(p3Index),
+      data(pScene->vertices[p1Index - 1], pScene->vertices[p2Index - 1], pScene->vertices[p3Index - 1], matIndex)
+{
+}
+
+/* Triangle-ray intersection routine. You will implement this. 
+Only the ray parameter and the barycentrics are computed here, the rest is filled in by hitAttributes for the closest hit. */
+bool Triangle::intersectHit(const Ray & ray, HitRecord & hit) const
+{
+    float t, beta, gamma;
+    if (!data.hit(ray, pScene->intTestEps, t, beta, gamma) || !(t < hit.t))
+        return false;
+
+    hit.t = t;
+    hit.beta = beta;
+    hit.gamma = gamma;
+    return true;
+}
+
+ReturnVal Triangle::hitAttributes(const Ray & ray, const HitRecord & hit) const
+{
+    ReturnVal result;
+    result.intersects = true;
+    result.t = hit.t;
+    result.intersection_point = ray.origin + (ray.direction * result.t);
+    result.normal = data.normal;
+    result.material_index = matIndex;
+    result.shape_type = 2;
+    result.shape_id = id;
+    //result.obj = this;
+    result.beta = hit.beta;
+    result.gamma = hit.gamma;
+    return result;
+}
+
+// Any-hit test for shadow rays, only the ray parameter is computed
+bool Triangle::occluded(const Ray & ray, float tmax) const
+{
+    float t, beta, gamma;
+    return data.hit(ray, pScene->intTestEps, t, beta, gamma) && t < tmax;
+}
+
+int Triangle::intersectPacket(const RayPacket & packet, HitRecord hits[PACKET_SIZE]) const
+{
+    vfloat4 t, beta, gamma;
+    int mask = data.hitPacket(packet, pScene->intTestEps, t, beta, gamma);
+    if (mask == 0)
+        return 0;
+
+    alignas(16) float ts[PACKET_SIZE], betas[PACKET_SIZE], gammas[PACKET_SIZE];
+    t.store(ts);
+    beta.store(betas);
+    gamma.store(gammas);
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
     {
-        result.intersects = true;
-        result.t = t;
-        result.intersection_point = ray.origin + (ray.direction * result.t);
-        result.normal = normal;
-        result.material_index = matIndex;
-        result.shape_type = 2;
-        result.shape_id = id;
-        //result.obj = this;
-        result.beta = beta;
-        result.gamma = gamma;
+        if (!(mask & (1 << lane)) || !(ts[lane] < hits[lane].t))
+        {
+            mask &= ~(1 << lane);
+            continue;
+        }
+        hits[lane].t = ts[lane];
+        hits[lane].beta = betas[lane];
+        hits[lane].gamma = gammas[lane];
     }
-    return result;
+    return mask;
+}
+
+AABB Triangle::getBoundingBox() const
+{
+    return data.getBoundingBox();
+}
+
+const TriangleData& Triangle::getData() const
+{
+    return data;
 }
 
 Mesh::Mesh()
+    : mappedFaces(nullptr), numMappedFaces(0), residentSet(nullptr), firstCluster(0)
 {}
 
 /* Constructor for mesh. You will implement this. */
-Mesh::Mesh(int id, int matIndex, const vector<Triangle>& faces)
-    : Shape(id, matIndex), faces(faces)
+Mesh::Mesh(int id, int matIndex, vector<TriangleData>&& faces)
+    : Shape(id, matIndex), faces(std::move(faces)), mappedFaces(nullptr), numMappedFaces(0), residentSet(nullptr), firstCluster(0)
 {
 	/***********************************************
      *                                             *
@@ -208,10 +373,159 @@ Mesh::Mesh(int id, int matIndex, const vector<Triangle>& faces)
 	 */
 }
 
+/* Builds the BVH over the faces. The faces are then stored in leaf order
+so that each leaf reads a contiguous range. */
+void Mesh::buildBVH(void)
+{
+    int num_tris = faces.size();
+    vector<AABB> face_bounds(num_tris);
+    for (int i = 0; i < num_tris; i++)
+    {
+        face_bounds[i] = faces[i].getBoundingBox();
+    }
+    bvh.build(face_bounds);
+
+    vector<TriangleData> ordered;
+    ordered.reserve(num_tris);
+    for (int i = 0; i < num_tris; i++)
+    {
+        ordered.push_back(faces[bvh.primIndices[i]]);
+        bvh.primIndices[i] = i;
+    }
+    faces.swap(ordered);
+}
+
+/* The faces are always transformed from the parsed ones, so errors do not pile up
+over the frames of an animation. The BVH keeps its tree, only its bounds are
+refit, which stays cheap as long as the mesh moves as a whole. */
+void Mesh::setTransform(const Transform& transform)
+{
+    // a mapped mesh is brought into memory the first time it moves
+    if (mappedFaces != nullptr)
+    {
+        faces.assign(mappedFaces, mappedFaces + numMappedFaces);
+        mappedFaces = nullptr;
+        residentSet = nullptr;
+    }
+    if (restFaces.empty())
+        restFaces = faces;
+
+    // the corners are transformed in batches that stay in the cache
+    const int batch = 256;
+    Vector3f v1[batch], v2[batch], v3[batch];
+    int num_tris = faces.size();
+    vector<AABB> face_bounds(num_tris);
+    for (int first = 0; first < num_tris; first += batch)
+    {
+        int count = std::min(batch, num_tris - first);
+        for (int k = 0; k < count; k++)
+        {
+            const TriangleData& rest = restFaces[first + k];
+            v1[k] = rest.vertex1;
+            v2[k] = rest.vertex1 - rest.edge1;
+            v3[k] = rest.vertex1 - rest.edge2;
+        }
+        transformPoints(transform, v1, v1, count);
+        transformPoints(transform, v2, v2, count);
+        transformPoints(transform, v3, v3, count);
+        for (int k = 0; k < count; k++)
+        {
+            int i = first + k;
+            faces[i] = TriangleData(v1[k], v2[k], v3[k], restFaces[i].matIndex);
+            face_bounds[i] = faces[i].getBoundingBox();
+        }
+    }
+    bvh.refit(face_bounds);
+}
+
+// Any-hit test for shadow rays, stops at the first face closer than tmax
+bool Mesh::occluded(const Ray & ray, float tmax) const
+{
+    float eps = pScene->intTestEps;
+    const TriangleData* faces = faceData();
+    int tests = 0;
+    bool occluded = bvh.occluded(ray, tmax, [&](int i, float tmax) {
+        float t, beta, gamma;
+        touchFace(i);
+        return faces[i].hit(ray, eps, t, beta, gamma) && t < tmax;
+    }, tests);
+    rayCounters.triangleTests += tests;
+    return occluded;
+}
+
+// Packet traversal of the face BVH, only the winning face of each ray is recorded
+int Mesh::intersectPacket(const RayPacket & packet, HitRecord hits[PACKET_SIZE]) const
+{
+    float eps = pScene->intTestEps;
+    const TriangleData* faces = faceData();
+    float tNear[PACKET_SIZE];
+    int closest_face[PACKET_SIZE];
+    float closest_beta[PACKET_SIZE], closest_gamma[PACKET_SIZE];
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+    {
+        tNear[lane] = hits[lane].t;
+        closest_face[lane] = -1;
+    }
+
+    int tests = bvh.traversePacket(packet, tNear, [&](int i, float* tmax) {
+        vfloat4 t, beta, gamma;
+        touchFace(i);
+        int mask = faces[i].hitPacket(packet, eps, t, beta, gamma);
+        if (mask == 0)
+            return;
+        mask &= (t < vfloat4::load(tmax)).mask();
+        if (mask == 0)
+            return;
+
+        alignas(16) float ts[PACKET_SIZE], betas[PACKET_SIZE], gammas[PACKET_SIZE];
+        t.store(ts);
+        beta.store(betas);
+        gamma.store(gammas);
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
+        {
+            if (mask & (1 << lane))
+            {
+                tmax[lane] = ts[lane];
+                closest_face[lane] = i;
+                closest_beta[lane] = betas[lane];
+                closest_gamma[lane] = gammas[lane];
+            }
+        }
+    });
+    rayCounters.triangleTests += tests * PACKET_SIZE;
+
+    int mask = 0;
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+    {
+        if (closest_face[lane] == -1)
+            continue;
+        hits[lane].t = tNear[lane];
+        hits[lane].prim = closest_face[lane];
+        hits[lane].beta = closest_beta[lane];
+        hits[lane].gamma = closest_gamma[lane];
+        mask |= 1 << lane;
+    }
+    return mask;
+}
+
+int Mesh::numFaces() const
+{
+    return (mappedFaces != nullptr) ? numMappedFaces : (int) faces.size();
+}
+
+const TriangleData* Mesh::faceData() const
+{
+    return (mappedFaces != nullptr) ? mappedFaces : faces.data();
+}
+
+AABB Mesh::getBoundingBox() const
+{
+    return bvh.bounds();
+}
+
 /* Mesh-ray intersection routine. You will implement this. 
-Note that ReturnVal structure should hold the information related to the intersection point, e.g., coordinate of that point, normal at that point etc. 
-You should to declare the variables in ReturnVal structure you think you will need. It is in defs.h file. */
-ReturnVal Mesh::intersect(const Ray & ray) const
+The faces are searched through the BVH, only the index and the barycentrics of the closest face are recorded. */
+bool Mesh::intersectHit(const Ray & ray, HitRecord & hit) const
 {
 	/***********************************************
      *                                             *
@@ -220,23 +534,115 @@ ReturnVal Mesh::intersect(const Ray & ray) const
      ***********************************************
 	 */
 
-    float tNear = std::numeric_limits<float>::infinity();
-    int closest_tri_id;
-    ReturnVal result;
-    result.intersects = false;
-    int num_tris = faces.size();
-
-    for (int i = 0; i < num_tris; i++)
-    {
-        Triangle tri = faces[i];
-        const ReturnVal tri_res = tri.intersect(ray);
-        if (tri_res.intersects && tri_res.t < tNear)
+    float eps = pScene->intTestEps;
+    const TriangleData* faces = faceData();
+    float tNear = hit.t;
+    int closest_face = -1;
+    float closest_beta = 0, closest_gamma = 0;
+
+    int tests = bvh.traverse(ray, tNear, [&](int i, float& tmax) {
+        float t, beta, gamma;
+        touchFace(i);
+        if (faces[i].hit(ray, eps, t, beta, gamma) && t < tmax)
         {
-            tNear = tri_res.t;
-            result = tri_res;
+            tmax = t;
+            closest_face = i;
+            closest_beta = beta;
+            closest_gamma = gamma;
         }
-    }
+    });
+    rayCounters.triangleTests += tests;
 
+    if (closest_face == -1)
+        return false;
+
+    hit.t = tNear;
+    hit.prim = closest_face;
+    hit.beta = closest_beta;
+    hit.gamma = closest_gamma;
+    return true;
+}
+
+ReturnVal Mesh::hitAttributes(const Ray & ray, const HitRecord & hit) const
+{
+    touchFace(hit.prim);
+    const TriangleData& face = faceData()[hit.prim];
+    ReturnVal result;
+    result.intersects = true;
+    result.t = hit.t;
+    result.intersection_point = ray.origin + (ray.direction * result.t);
+    result.normal = face.normal;
+    result.material_index = face.matIndex;
+    result.shape_type = 2;
+    result.shape_id = -1;
+    result.beta = hit.beta;
+    result.gamma = hit.gamma;
     return result;
+}
 
+MeshInstance::MeshInstance()
+{}
+
+MeshInstance::MeshInstance(int id, int matIndex, int meshIndex, const Transform& objectToWorld)
+    : Shape(id, matIndex), meshIndex(meshIndex), objectToWorld(objectToWorld), worldToObject(objectToWorld.inverse())
+{
+}
+
+void MeshInstance::setTransform(const Transform& objectToWorld)
+{
+    this->objectToWorld = objectToWorld;
+    worldToObject = objectToWorld.inverse();
+}
+
+Ray MeshInstance::toObject(const Ray & ray) const
+{
+    return Ray(worldToObject.point(ray.origin), worldToObject.vector(ray.direction));
+}
+
+bool MeshInstance::intersectHit(const Ray & ray, HitRecord & hit) const
+{
+    return pScene->meshes[meshIndex].intersectHit(toObject(ray), hit);
+}
+
+// The face normal is brought back with the inverse transpose, the point is taken on the world ray
+ReturnVal MeshInstance::hitAttributes(const Ray & ray, const HitRecord & hit) const
+{
+    ReturnVal result = pScene->meshes[meshIndex].hitAttributes(toObject(ray), hit);
+    result.intersection_point = ray.origin + (ray.direction * result.t);
+    result.normal = worldToObject.transposedVector(result.normal).normalize();
+    result.material_index = matIndex;
+    result.shape_id = id;
+    return result;
+}
+
+bool MeshInstance::occluded(const Ray & ray, float tmax) const
+{
+    return pScene->meshes[meshIndex].occluded(toObject(ray), tmax);
+}
+
+int MeshInstance::intersectPacket(const RayPacket & packet, HitRecord hits[PACKET_SIZE]) const
+{
+    Ray rays[PACKET_SIZE];
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+    {
+        rays[lane] = toObject(Ray(Vector3f(packet.ox[lane], packet.oy[lane], packet.oz[lane]),
+                                  Vector3f(packet.dx[lane], packet.dy[lane], packet.dz[lane])));
+    }
+    return pScene->meshes[meshIndex].intersectPacket(RayPacket(rays), hits);
+}
+
+// Bounds of the transformed corners of the base mesh bounds
+AABB MeshInstance::getBoundingBox() const
+{
+    AABB local = pScene->meshes[meshIndex].getBoundingBox();
+    AABB box;
+    if (local.min.x > local.max.x)
+        return box;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        Vector3f p((corner & 1) ? local.max.x : local.min.x, (corner & 2) ? local.max.y : local.min.y, (corner & 4) ? local.max.z : local.min.z);
+        box.expand(objectToWorld.point(p));
+    }
+    box.pad();
+    return box;
 }
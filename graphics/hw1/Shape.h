@@ -3,19 +3,44 @@
 
 #include <vector>
 #include "Ray.h"
+#include "BVH.h"
+#include "RayPacket.h"
+#include "ResidentSet.h"
 #include "defs.h"
 
 using namespace std;
 
-// Base class for any shape object
+// Triangle data precomputed at scene load. Laid out to fill exactly one cache line
+// so that an intersection test touches a single line and needs no vertex lookups.
+typedef struct alignas(64) TriangleData
+{
+	Vector3f vertex1;	// First vertex
+	Vector3f edge1;		// vertex1 - vertex2
+	Vector3f edge2;		// vertex1 - vertex3
+	Vector3f normal;	// Unit face normal
+	int matIndex;		// Material index of the triangle
+
+	TriangleData();
+	TriangleData(const Vector3f& vertex1, const Vector3f& vertex2, const Vector3f& vertex3, int matIndex);
+
+	bool hit(const Ray & ray, float eps, float & t, float & beta, float & gamma) const;	// Ray-triangle test, rejects back faces
+	int hitPacket(const RayPacket & packet, float eps, vfloat4 & t, vfloat4 & beta, vfloat4 & gamma) const;	// Same test for a packet, returns the lane mask of hits
+	AABB getBoundingBox() const;
+} TriangleData;
+
+// Base class for any shape object. Shapes are stored by value in one array per type
+// and have no virtual methods, every type provides the same set of intersection methods:
+//	intersectHit	lean closest hit test, updates t, prim and the barycentrics of hit when the shape is hit closer than hit.t
+//	hitAttributes	surface information of a hit found by intersectHit
+//	occluded		whether the ray hits the shape before tmax, used for shadow rays
+//	intersectPacket	packet version of intersectHit, returns the mask of lanes whose hit was updated
+//	getBoundingBox	bounding box of the shape, used to build the scene BVHs
 class Shape
 {
 public: 
 	int id;	        // Id of the shape
 	int matIndex;	// Material index of the shape
 
-	virtual ReturnVal intersect(const Ray & ray) const = 0; // Pure virtual method for intersection test. You must implement this for sphere, triangle, and mesh. 
-
     Shape(void);
     Shape(int id, int matIndex); // Constructor
 
@@ -29,13 +54,22 @@ class Sphere: public Shape
 public:
 	Sphere(void);	// Constructor
 	Sphere(int id, int matIndex, int cIndex, float R);	// Constructor
-	ReturnVal intersect(const Ray & ray) const;	// Will take a ray and return a structure related to the intersection information. You will implement this. 
+	bool intersectHit(const Ray & ray, HitRecord & hit) const;
+	ReturnVal hitAttributes(const Ray & ray, const HitRecord & hit) const;
+	bool occluded(const Ray & ray, float tmax) const;
+	int intersectPacket(const RayPacket & packet, HitRecord hits[PACKET_SIZE]) const;
+	AABB getBoundingBox() const;
 
 private:
+	friend class SceneCache;
+	friend class GBuffer;
+
 	// Write any other stuff here
 	int cIndex;
 	float R;
 	//Vector3f center;
+
+	bool hit(const Ray & ray, float & t) const;
 };
 
 // Class for triangle
@@ -44,13 +78,20 @@ class Triangle: public Shape
 public:
 	Triangle(void);	// Constructor
 	Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index);	// Constructor
-	ReturnVal intersect(const Ray & ray) const; // Will take a ray and return a structure related to the intersection information. You will implement this. 
+	bool intersectHit(const Ray & ray, HitRecord & hit) const;
+	ReturnVal hitAttributes(const Ray & ray, const HitRecord & hit) const;
+	bool occluded(const Ray & ray, float tmax) const;
+	int intersectPacket(const RayPacket & packet, HitRecord hits[PACKET_SIZE]) const;
+	AABB getBoundingBox() const;
+	const TriangleData& getData() const;	// Precomputed data of the triangle
 
 private:
+	friend class SceneCache;
+	friend class GBuffer;
+
 	// Write any other stuff here
 	int p1Index, p2Index, p3Index;
-	//Vector3f vertex1, vertex2, vertex3;
-	//Vector3f normal;
+	TriangleData data;
 };
 
 // Class for mesh
@@ -58,12 +99,62 @@ class Mesh: public Shape
 {
 public:
 	Mesh(void);	// Constructor
-	Mesh(int id, int matIndex, const vector<Triangle>& faces);	// Constructor
-	ReturnVal intersect(const Ray & ray) const; // Will take a ray and return a structure related to the intersection information. You will implement this. 
+	Mesh(int id, int matIndex, vector<TriangleData>&& faces);	// Constructor
+	void buildBVH(void);	// Builds the BVH over the faces, must be called before any intersection test
+	void setTransform(const Transform& transform);	// Places the faces as parsed by transform and refits the BVH
+	bool intersectHit(const Ray & ray, HitRecord & hit) const;
+	ReturnVal hitAttributes(const Ray & ray, const HitRecord & hit) const;
+	bool occluded(const Ray & ray, float tmax) const;
+	int intersectPacket(const RayPacket & packet, HitRecord hits[PACKET_SIZE]) const;
+	AABB getBoundingBox() const;
+	int numFaces() const;
+	const TriangleData* faceData() const;	// The faces in memory or in the mapped scene cache
 
 private:
+	friend class SceneCache;
+	friend class GBuffer;
+
 	// Write any other stuff here
-	vector<Triangle> faces;
+	vector<TriangleData> faces;	// Precomputed faces, stored in BVH leaf order
+	vector<TriangleData> restFaces;	// Faces as parsed, kept once the mesh is moved
+	BVH bvh;	// BVH over the faces, built by buildBVH
+
+	// Out of core the faces and the BVH stay in the mapped scene cache and faces is empty
+	const TriangleData* mappedFaces;	// Null when the faces are in memory
+	int numMappedFaces;
+	ResidentSet* residentSet;	// Pages the mapped faces in and out, null when they are in memory
+	int firstCluster;			// Cluster of the first face in residentSet
+
+	void touchFace(int i) const	// Reports the read of face i to the resident set
+	{
+		if (residentSet != nullptr)
+			residentSet->touch(firstCluster + (int) ((size_t) i * sizeof(TriangleData) / CLUSTER_BYTES));
+	}
+};
+
+// Placement of a mesh with its own transform and material. The faces and the
+// BVH stay with the base mesh, rays are moved into its space instead.
+class MeshInstance: public Shape
+{
+public:
+	MeshInstance(void);	// Constructor
+	MeshInstance(int id, int matIndex, int meshIndex, const Transform& objectToWorld);	// Constructor, meshIndex is the position of the base mesh in Scene::meshes
+	bool intersectHit(const Ray & ray, HitRecord & hit) const;
+	ReturnVal hitAttributes(const Ray & ray, const HitRecord & hit) const;
+	bool occluded(const Ray & ray, float tmax) const;
+	int intersectPacket(const RayPacket & packet, HitRecord hits[PACKET_SIZE]) const;
+	AABB getBoundingBox() const;	// Needs the BVH of the base mesh
+	void setTransform(const Transform& objectToWorld);
+
+private:
+	friend class SceneCache;
+	friend class GBuffer;
+
+	int meshIndex;
+	Transform objectToWorld;
+	Transform worldToObject;
+
+	Ray toObject(const Ray & ray) const;	// Direction is not normalized, so hit distances stay the same in both spaces
 };
 
 #endif
@@ -0,0 +1,124 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RT_USE_SSE 1
+#endif
+
+// 4 wide float and mask types used by the packet tracer.
+// They map onto SSE registers when available and onto plain arrays otherwise,
+// every lane follows the same IEEE single precision operations as scalar code.
+
+#ifdef RT_USE_SSE
+
+typedef struct vbool4
+{
+	__m128 m;
+
+	vbool4() {}
+	vbool4(__m128 m) : m(m) {}
+
+	int mask() const { return _mm_movemask_ps(m); }	// bit i is set when lane i is true
+} vbool4;
+
+typedef struct vfloat4
+{
+	__m128 v;
+
+	vfloat4() {}
+	vfloat4(__m128 v) : v(v) {}
+	explicit vfloat4(float f) : v(_mm_set1_ps(f)) {}
+
+	static vfloat4 load(const float* p) { return _mm_load_ps(p); }	// p must be 16 byte aligned
+	void store(float* p) const { _mm_store_ps(p, v); }
+} vfloat4;
+
+inline vfloat4 operator+(vfloat4 a, vfloat4 b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat4 operator-(vfloat4 a, vfloat4 b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat4 operator*(vfloat4 a, vfloat4 b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat4 operator/(vfloat4 a, vfloat4 b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat4 operator-(vfloat4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+
+inline vbool4 operator<(vfloat4 a, vfloat4 b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vbool4 operator<=(vfloat4 a, vfloat4 b) { return _mm_cmple_ps(a.v, b.v); }
+inline vbool4 operator>(vfloat4 a, vfloat4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline vbool4 operator>=(vfloat4 a, vfloat4 b) { return _mm_cmpge_ps(a.v, b.v); }
+
+inline vbool4 operator&(vbool4 a, vbool4 b) { return _mm_and_ps(a.m, b.m); }
+inline vbool4 operator|(vbool4 a, vbool4 b) { return _mm_or_ps(a.m, b.m); }
+inline vbool4 operator!(vbool4 a) { return _mm_xor_ps(a.m, _mm_castsi128_ps(_mm_set1_epi32(-1))); }
+
+inline vfloat4 vmin(vfloat4 a, vfloat4 b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat4 vmax(vfloat4 a, vfloat4 b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat4 vsqrt(vfloat4 a) { return _mm_sqrt_ps(a.v); }
+inline vfloat4 vabs(vfloat4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+
+// lane i of the result is a[i] where m is true and b[i] otherwise
+inline vfloat4 select(vbool4 m, vfloat4 a, vfloat4 b) { return _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v)); }
+
+// negated comparisons, true in the lanes where a or b is NaN like !(a > b) on scalars
+inline vbool4 not_greater(vfloat4 a, vfloat4 b) { return _mm_cmpngt_ps(a.v, b.v); }
+inline vbool4 not_less(vfloat4 a, vfloat4 b) { return _mm_cmpnlt_ps(a.v, b.v); }
+inline vbool4 not_less_equal(vfloat4 a, vfloat4 b) { return _mm_cmpnle_ps(a.v, b.v); }
+
+#else
+
+typedef struct vbool4
+{
+	bool b[4];
+
+	int mask() const { return (b[0] ? 1 : 0) | (b[1] ? 2 : 0) | (b[2] ? 4 : 0) | (b[3] ? 8 : 0); }
+} vbool4;
+
+typedef struct vfloat4
+{
+	float v[4];
+
+	vfloat4() {}
+	explicit vfloat4(float f) { v[0] = v[1] = v[2] = v[3] = f; }
+
+	static vfloat4 load(const float* p) { vfloat4 r; for (int i = 0; i < 4; i++) r.v[i] = p[i]; return r; }
+	void store(float* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+} vfloat4;
+
+#define RT_VFLOAT4_OP(op) \
+	inline vfloat4 operator op(vfloat4 a, vfloat4 b) { vfloat4 r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] op b.v[i]; return r; }
+#define RT_VFLOAT4_CMP(op) \
+	inline vbool4 operator op(vfloat4 a, vfloat4 b) { vbool4 r; for (int i = 0; i < 4; i++) r.b[i] = a.v[i] op b.v[i]; return r; }
+
+RT_VFLOAT4_OP(+)
+RT_VFLOAT4_OP(-)
+RT_VFLOAT4_OP(*)
+RT_VFLOAT4_OP(/)
+RT_VFLOAT4_CMP(<)
+RT_VFLOAT4_CMP(<=)
+RT_VFLOAT4_CMP(>)
+RT_VFLOAT4_CMP(>=)
+
+#undef RT_VFLOAT4_OP
+#undef RT_VFLOAT4_CMP
+
+inline vfloat4 operator-(vfloat4 a) { vfloat4 r; for (int i = 0; i < 4; i++) r.v[i] = -a.v[i]; return r; }
+
+inline vbool4 operator&(vbool4 a, vbool4 b) { vbool4 r; for (int i = 0; i < 4; i++) r.b[i] = a.b[i] && b.b[i]; return r; }
+inline vbool4 operator|(vbool4 a, vbool4 b) { vbool4 r; for (int i = 0; i < 4; i++) r.b[i] = a.b[i] || b.b[i]; return r; }
+inline vbool4 operator!(vbool4 a) { vbool4 r; for (int i = 0; i < 4; i++) r.b[i] = !a.b[i]; return r; }
+
+// min and max return the second operand when a lane is NaN, like minps and maxps
+inline vfloat4 vmin(vfloat4 a, vfloat4 b) { vfloat4 r; for (int i = 0; i < 4; i++) r.v[i] = (a.v[i] < b.v[i]) ? a.v[i] : b.v[i]; return r; }
+inline vfloat4 vmax(vfloat4 a, vfloat4 b) { vfloat4 r; for (int i = 0; i < 4; i++) r.v[i] = (a.v[i] > b.v[i]) ? a.v[i] : b.v[i]; return r; }
+inline vfloat4 vsqrt(vfloat4 a) { vfloat4 r; for (int i = 0; i < 4; i++) r.v[i] = std::sqrt(a.v[i]); return r; }
+inline vfloat4 vabs(vfloat4 a) { vfloat4 r; for (int i = 0; i < 4; i++) r.v[i] = std::fabs(a.v[i]); return r; }
+
+inline vfloat4 select(vbool4 m, vfloat4 a, vfloat4 b) { vfloat4 r; for (int i = 0; i < 4; i++) r.v[i] = m.b[i] ? a.v[i] : b.v[i]; return r; }
+
+inline vbool4 not_greater(vfloat4 a, vfloat4 b) { return !(a > b); }
+inline vbool4 not_less(vfloat4 a, vfloat4 b) { return !(a < b); }
+inline vbool4 not_less_equal(vfloat4 a, vfloat4 b) { return !(a <= b); }
+
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+#include "Stats.h"
+#include <chrono>
+
+thread_local RayCounters rayCounters;
+
+RayCounters& RayCounters::operator+=(const RayCounters& right)
+{
+    primaryRays += right.primaryRays;
+    shadowRays += right.shadowRays;
+    reflectionRays += right.reflectionRays;
+    triangleTests += right.triangleTests;
+    sphereTests += right.sphereTests;
+    return *this;
+}
+
+RayCounters RayCounters::operator-(const RayCounters& right) const
+{
+    RayCounters result;
+    result.primaryRays = primaryRays - right.primaryRays;
+    result.shadowRays = shadowRays - right.shadowRays;
+    result.reflectionRays = reflectionRays - right.reflectionRays;
+    result.triangleTests = triangleTests - right.triangleTests;
+    result.sphereTests = sphereTests - right.sphereTests;
+    return result;
+}
+
+double currentSeconds(void)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+RenderStats::RenderStats()
+    : fromCache(false), parseSeconds(0), buildSeconds(0), renderSeconds(0), clusterPageIns(0), clusterEvictions(0)
+{
+}
+
+RayCounters RenderStats::total() const
+{
+    RayCounters result;
+    for (const CameraStats& cam : cameras)
+    {
+        for (const ThreadStats& thread : cam.threads)
+        {
+            result += thread.counters;
+        }
+    }
+    return result;
+}
+
+static double per(double a, double b)
+{
+    return (b > 0) ? a / b : 0;
+}
+
+void RenderStats::printTable(FILE *output) const
+{
+    RayCounters sum = total();
+    double render_seconds = renderSeconds;
+    long long pixels = 0;
+    for (const CameraStats& cam : cameras)
+        pixels += (long long) cam.width * cam.height;
+
+    fprintf(output, "%-28s %12.3f ms%s\n", "scene load", parseSeconds * 1e3, fromCache ? " (cache)" : "");
+    fprintf(output, "%-28s %12.3f ms\n", "acceleration build", buildSeconds * 1e3);
+    fprintf(output, "%-28s %12.3f ms\n", "render", render_seconds * 1e3);
+    fprintf(output, "%-28s %12lld\n", "primary rays", sum.primaryRays);
+    fprintf(output, "%-28s %12.2f\n", "primary rays per pixel", per(sum.primaryRays, pixels));
+    fprintf(output, "%-28s %12lld\n", "shadow rays", sum.shadowRays);
+    fprintf(output, "%-28s %12lld\n", "reflection rays", sum.reflectionRays);
+    fprintf(output, "%-28s %12.2f\n", "triangle tests per ray", per(sum.triangleTests, sum.totalRays()));
+    fprintf(output, "%-28s %12.2f\n", "sphere tests per ray", per(sum.sphereTests, sum.totalRays()));
+    fprintf(output, "%-28s %12.0f\n", "rays per second", per(sum.totalRays(), render_seconds));
+    if (clusterPageIns > 0)
+    {
+        fprintf(output, "%-28s %12lld\n", "clusters paged in", clusterPageIns);
+        fprintf(output, "%-28s %12lld\n", "clusters evicted", clusterEvictions);
+    }
+
+    for (const CameraStats& cam : cameras)
+    {
+        RayCounters cam_sum;
+        for (const ThreadStats& thread : cam.threads)
+            cam_sum += thread.counters;
+        fprintf(output, "\ncamera %s (%dx%d): %.3f ms, %.2f primary rays per pixel\n", cam.imageName.c_str(), cam.width, cam.height,
+                cam.renderSeconds * 1e3, per(cam_sum.primaryRays, (double) cam.width * cam.height));
+        fprintf(output, "  %6s %12s %12s %12s %12s %14s\n", "thread", "primary", "shadow", "reflection", "busy ms", "rays/s");
+        for (size_t t = 0; t < cam.threads.size(); t++)
+        {
+            const ThreadStats& thread = cam.threads[t];
+            fprintf(output, "  %6d %12lld %12lld %12lld %12.3f %14.0f\n", (int) t,
+                    thread.counters.primaryRays, thread.counters.shadowRays, thread.counters.reflectionRays,
+                    thread.renderSeconds * 1e3, per(thread.counters.totalRays(), thread.renderSeconds));
+        }
+    }
+}
+
+static void write_counters(FILE *output, const RayCounters& c)
+{
+    fprintf(output, "\"primary_rays\": %lld, \"shadow_rays\": %lld, \"reflection_rays\": %lld, \"triangle_tests\": %lld, \"sphere_tests\": %lld",
+            c.primaryRays, c.shadowRays, c.reflectionRays, c.triangleTests, c.sphereTests);
+}
+
+// Writes a JSON escaped string literal
+static void write_string(FILE *output, const string& str)
+{
+    fputc('"', output);
+    for (char ch : str)
+    {
+        if (ch == '"' || ch == '\\')
+            fputc('\\', output);
+        if ((unsigned char) ch < 0x20)
+            fprintf(output, "\\u%04x", ch);
+        else
+            fputc(ch, output);
+    }
+    fputc('"', output);
+}
+
+bool RenderStats::writeJSON(const char *path) const
+{
+    FILE *output = fopen(path, "w");
+    if (output == nullptr)
+        return false;
+
+    RayCounters sum = total();
+    double render_seconds = renderSeconds;
+
+    fprintf(output, "{\n  \"from_cache\": %s,\n", fromCache ? "true" : "false");
+    fprintf(output, "  \"parse_seconds\": %.6f,\n  \"build_seconds\": %.6f,\n  \"render_seconds\": %.6f,\n",
+            parseSeconds, buildSeconds, render_seconds);
+    fprintf(output, "  \"cluster_page_ins\": %lld,\n  \"cluster_evictions\": %lld,\n", clusterPageIns, clusterEvictions);
+    fprintf(output, "  \"totals\": {");
+    write_counters(output, sum);
+    fprintf(output, ", \"triangle_tests_per_ray\": %.4f, \"sphere_tests_per_ray\": %.4f, \"rays_per_second\": %.1f},\n",
+            per(sum.triangleTests, sum.totalRays()), per(sum.sphereTests, sum.totalRays()), per(sum.totalRays(), render_seconds));
+
+    fprintf(output, "  \"cameras\": [");
+    for (size_t c = 0; c < cameras.size(); c++)
+    {
+        const CameraStats& cam = cameras[c];
+        fprintf(output, "%s\n    {\"image\": ", (c > 0) ? "," : "");
+        write_string(output, cam.imageName);
+        RayCounters cam_sum;
+        for (const ThreadStats& thread : cam.threads)
+            cam_sum += thread.counters;
+        fprintf(output, ", \"width\": %d, \"height\": %d, \"render_seconds\": %.6f, \"primary_rays_per_pixel\": %.4f, \"threads\": [",
+                cam.width, cam.height, cam.renderSeconds, per(cam_sum.primaryRays, (double) cam.width * cam.height));
+        for (size_t t = 0; t < cam.threads.size(); t++)
+        {
+            const ThreadStats& thread = cam.threads[t];
+            fprintf(output, "%s\n      {\"thread\": %d, ", (t > 0) ? "," : "", (int) t);
+            write_counters(output, thread.counters);
+            fprintf(output, ", \"busy_seconds\": %.6f, \"rays_per_second\": %.1f}",
+                    thread.renderSeconds, per(thread.counters.totalRays(), thread.renderSeconds));
+        }
+        fprintf(output, "]}");
+    }
+    fprintf(output, "\n  ]\n}\n");
+
+    return fclose(output) == 0;
+}
@@ -0,0 +1,69 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Ray and primitive test counters. Every thread counts into its own copy,
+// see rayCounters, so the hot paths never share a cache line.
+typedef struct RayCounters
+{
+	long long primaryRays;
+	long long shadowRays;
+	long long reflectionRays;
+	long long triangleTests;
+	long long sphereTests;
+
+	RayCounters() : primaryRays(0), shadowRays(0), reflectionRays(0), triangleTests(0), sphereTests(0) {}
+
+	long long totalRays() const { return primaryRays + shadowRays + reflectionRays; }
+
+	RayCounters& operator+=(const RayCounters& right);
+	RayCounters operator-(const RayCounters& right) const;
+} RayCounters;
+
+extern thread_local RayCounters rayCounters;	// Counters of the calling thread
+
+// Work done by one render thread for one camera
+typedef struct ThreadStats
+{
+	RayCounters counters;
+	double renderSeconds;	// Time spent rendering tiles
+
+	ThreadStats() : renderSeconds(0) {}
+} ThreadStats;
+
+typedef struct CameraStats
+{
+	string imageName;
+	int width;
+	int height;
+	double renderSeconds;		// Time from the start of the batch until the last tile of the camera was done
+	vector<ThreadStats> threads;	// Indexed by worker
+} CameraStats;
+
+// Timings and counters of a whole run, printed with --stats
+class RenderStats
+{
+public:
+	bool fromCache;			// Whether the scene came from the binary cache
+	double parseSeconds;	// Time to read the scene, XML or cache
+	double buildSeconds;	// Time to build the acceleration structures
+	double renderSeconds;	// Wall time of rendering all cameras of all frames, without saving the images
+	long long clusterPageIns;	// Mesh face clusters paged in from the scene cache, out of core only
+	long long clusterEvictions;	// Clusters dropped to stay within the resident budget
+	vector<CameraStats> cameras;
+
+	RenderStats();
+
+	RayCounters total() const;					// Counters summed over all cameras and threads
+	void printTable(FILE *output) const;		// Human readable report
+	bool writeJSON(const char *path) const;		// Same report as JSON
+};
+
+double currentSeconds(void);	// Monotonic clock in seconds
+
+#endif
@@ -0,0 +1,132 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int numThreads)
+    : job(nullptr), generation(0), active(0), stopping(false)
+{
+    if (numThreads < 1)
+        numThreads = 1;
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        queues.push_back(new WorkQueue());
+    }
+
+    for (int i = 1; i < numThreads; i++)
+    {
+        threads.push_back(thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wakeCond.notify_all();
+
+    for (thread& t : threads)
+    {
+        t.join();
+    }
+
+    for (WorkQueue* queue : queues)
+    {
+        delete queue;
+    }
+}
+
+int ThreadPool::size() const
+{
+    return queues.size();
+}
+
+/* Distributes the tasks to the workers in contiguous blocks, so neighbouring
+tasks start on the same worker, then wakes the workers and helps them out. */
+void ThreadPool::run(int numTasks, const function<void(int, int)>& job)
+{
+    int num_workers = queues.size();
+    for (int w = 0; w < num_workers; w++)
+    {
+        lock_guard<mutex> guard(queues[w]->lock);
+        int begin = (long long) numTasks * w / num_workers;
+        int end = (long long) numTasks * (w + 1) / num_workers;
+        for (int task = begin; task < end; task++)
+        {
+            queues[w]->tasks.push_back(task);
+        }
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        this->job = &job;
+        active = threads.size();
+        generation++;
+    }
+    wakeCond.notify_all();
+
+    processTasks(0);
+
+    unique_lock<mutex> guard(lock);
+    doneCond.wait(guard, [this] { return active == 0; });
+    this->job = nullptr;
+}
+
+void ThreadPool::workerLoop(int worker)
+{
+    int seen = 0;
+    while (true)
+    {
+        {
+            unique_lock<mutex> guard(lock);
+            wakeCond.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+
+        processTasks(worker);
+
+        lock_guard<mutex> guard(lock);
+        if (--active == 0)
+            doneCond.notify_all();
+    }
+}
+
+void ThreadPool::processTasks(int worker)
+{
+    int task;
+    while (popTask(worker, task))
+    {
+        (*job)(task, worker);
+    }
+}
+
+// Takes the newest task of the worker's own queue, or steals the oldest task of another queue
+bool ThreadPool::popTask(int worker, int& task)
+{
+    {
+        lock_guard<mutex> guard(queues[worker]->lock);
+        if (!queues[worker]->tasks.empty())
+        {
+            task = queues[worker]->tasks.back();
+            queues[worker]->tasks.pop_back();
+            return true;
+        }
+    }
+
+    int num_workers = queues.size();
+    for (int i = 1; i < num_workers; i++)
+    {
+        WorkQueue* victim = queues[(worker + i) % num_workers];
+        lock_guard<mutex> guard(victim->lock);
+        if (!victim->tasks.empty())
+        {
+            task = victim->tasks.front();
+            victim->tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
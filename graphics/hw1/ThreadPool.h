@@ -0,0 +1,50 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Work stealing thread pool. Tasks are integers handed to a job function;
+// each worker owns a queue, pops from its back and steals from the front of
+// the other queues once its own runs dry. The calling thread acts as worker 0.
+class ThreadPool
+{
+public:
+	ThreadPool(int numThreads);	// Constructor, numThreads includes the calling thread
+	~ThreadPool();
+
+	int size() const;	// Number of workers including the calling thread
+
+	// Runs job(task, worker) for every task in [0, numTasks) and returns when all are done
+	void run(int numTasks, const function<void(int, int)>& job);
+
+private:
+	typedef struct WorkQueue
+	{
+		mutex lock;
+		deque<int> tasks;
+	} WorkQueue;
+
+	vector<thread> threads;
+	vector<WorkQueue *> queues;
+
+	mutex lock;
+	condition_variable wakeCond;
+	condition_variable doneCond;
+	const function<void(int, int)> *job;
+	int generation;
+	int active;
+	bool stopping;
+
+	void workerLoop(int worker);
+	void processTasks(int worker);
+	bool popTask(int worker, int& task);
+};
+
+#endif
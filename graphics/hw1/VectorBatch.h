@@ -0,0 +1,138 @@
+#ifndef _VECTORBATCH_H_
+#define _VECTORBATCH_H_
+
+#include "Simd.h"
+#include "defs.h"
+
+// Four Vector3f in structure of arrays layout, one SIMD lane per vector.
+// Every operation rounds like its Vector3f counterpart, lane by lane,
+// so batched code gives the same results as the scalar code it replaces.
+typedef struct vvector3
+{
+	vfloat4 x;
+	vfloat4 y;
+	vfloat4 z;
+
+	vvector3() {}
+	vvector3(vfloat4 x, vfloat4 y, vfloat4 z) : x(x), y(y), z(z) {}
+	explicit vvector3(const Vector3f& v) : x(v.x), y(v.y), z(v.z) {}	// Same vector in every lane
+
+	// Transposes four consecutive vectors into the lanes
+	static vvector3 load(const Vector3f v[4])
+	{
+#ifdef RT_USE_SSE
+		Vector4f rows[4] = {Vector4f(v[0], 0), Vector4f(v[1], 0), Vector4f(v[2], 0), Vector4f(v[3], 0)};
+		__m128 r0 = _mm_load_ps(&rows[0].x), r1 = _mm_load_ps(&rows[1].x);
+		__m128 r2 = _mm_load_ps(&rows[2].x), r3 = _mm_load_ps(&rows[3].x);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		return vvector3(r0, r1, r2);
+#else
+		alignas(16) float xs[4], ys[4], zs[4];
+		for (int i = 0; i < 4; i++)
+		{
+			xs[i] = v[i].x;
+			ys[i] = v[i].y;
+			zs[i] = v[i].z;
+		}
+		return vvector3(vfloat4::load(xs), vfloat4::load(ys), vfloat4::load(zs));
+#endif
+	}
+
+	void store(Vector3f v[4]) const
+	{
+		alignas(16) float xs[4], ys[4], zs[4];
+		x.store(xs);
+		y.store(ys);
+		z.store(zs);
+		for (int i = 0; i < 4; i++)
+			v[i] = Vector3f(xs[i], ys[i], zs[i]);
+	}
+} vvector3;
+
+inline vvector3 operator+(const vvector3& a, const vvector3& b) { return vvector3(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline vvector3 operator-(const vvector3& a, const vvector3& b) { return vvector3(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline vvector3 operator*(const vvector3& a, vfloat4 k) { return vvector3(k * a.x, k * a.y, k * a.z); }
+
+inline vfloat4 dot(const vvector3& a, const vvector3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+inline vvector3 cross(const vvector3& a, const vvector3& b)
+{
+	return vvector3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+// a * k + c, rounded after the product like madd on Vector3f
+inline vvector3 madd(const vvector3& a, vfloat4 k, const vvector3& c)
+{
+	return vvector3(a.x * k + c.x, a.y * k + c.y, a.z * k + c.z);
+}
+
+inline vvector3 normalize(const vvector3& v)
+{
+	vfloat4 len = vsqrt(dot(v, v));
+	return vvector3(v.x / len, v.y / len, v.z / len);
+}
+
+inline vvector3 transformPoint(const Transform& t, const vvector3& p)
+{
+	return vvector3(vfloat4(t.m[0][0]) * p.x + vfloat4(t.m[0][1]) * p.y + vfloat4(t.m[0][2]) * p.z + vfloat4(t.m[0][3]),
+					vfloat4(t.m[1][0]) * p.x + vfloat4(t.m[1][1]) * p.y + vfloat4(t.m[1][2]) * p.z + vfloat4(t.m[1][3]),
+					vfloat4(t.m[2][0]) * p.x + vfloat4(t.m[2][1]) * p.y + vfloat4(t.m[2][2]) * p.z + vfloat4(t.m[2][3]));
+}
+
+inline vvector3 transformVector(const Transform& t, const vvector3& v)
+{
+	return vvector3(vfloat4(t.m[0][0]) * v.x + vfloat4(t.m[0][1]) * v.y + vfloat4(t.m[0][2]) * v.z,
+					vfloat4(t.m[1][0]) * v.x + vfloat4(t.m[1][1]) * v.y + vfloat4(t.m[1][2]) * v.z,
+					vfloat4(t.m[2][0]) * v.x + vfloat4(t.m[2][1]) * v.y + vfloat4(t.m[2][2]) * v.z);
+}
+
+/* Batch versions of the Vector3f and Transform operations over arrays of n vectors.
+They run four vectors at a time and the last n % 4 one by one, in and out may be
+the same array. */
+
+// out[i] = t.point(in[i])
+inline void transformPoints(const Transform& t, const Vector3f* in, Vector3f* out, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+		transformPoint(t, vvector3::load(in + i)).store(out + i);
+	for (; i < n; i++)
+		out[i] = t.point(in[i]);
+}
+
+// out[i] = t.vector(in[i])
+inline void transformVectors(const Transform& t, const Vector3f* in, Vector3f* out, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+		transformVector(t, vvector3::load(in + i)).store(out + i);
+	for (; i < n; i++)
+		out[i] = t.vector(in[i]);
+}
+
+// out[i] = in[i].normalize()
+inline void normalizeVectors(const Vector3f* in, Vector3f* out, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+		normalize(vvector3::load(in + i)).store(out + i);
+	for (; i < n; i++)
+		out[i] = in[i].normalize();
+}
+
+// out[i] = a[i] * b[i]
+inline void dotProducts(const Vector3f* a, const Vector3f* b, float* out, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		alignas(16) float d[4];
+		dot(vvector3::load(a + i), vvector3::load(b + i)).store(d);
+		for (int k = 0; k < 4; k++)
+			out[i + k] = d[k];
+	}
+	for (; i < n; i++)
+		out[i] = a[i] * b[i];
+}
+
+#endif
@@ -0,0 +1,222 @@
+#include "Scene.h"
+#include "Camera.h"
+#include "Light.h"
+#include "Material.h"
+#include "Stats.h"
+
+// A ray of the wavefront renderer together with its closest hit. Every stage of a
+// tile holds the vertices of one recursion depth, their colors are resolved from
+// the deepest stage back to the primary rays once all rays have been traced.
+typedef struct PathVertex
+{
+    Ray ray;
+    ReturnVal hit;
+    int parent;     // Pixel index inside the tile for primary rays, vertex of the previous stage otherwise
+    int child;      // Reflection vertex in the next stage, -1 if no reflection ray was traced
+    Vector3f color;
+} PathVertex;
+
+typedef struct ShadowQuery
+{
+    Ray ray;
+    float tmax;
+    int vertex;
+    int light;
+} ShadowQuery;
+
+// Octant of the ray direction, rays in the same octant traverse the BVH in a similar order
+static int direction_octant(const Vector3f& d)
+{
+    return (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0);
+}
+
+// Orders the vertices of a stage by direction octant. The sort is stable, so
+// within an octant the rays keep the pixel order they inherited from the primary rays.
+static void bin_by_direction(const vector<PathVertex>& stage, vector<int>& order)
+{
+    int counts[9] = {0};
+    for (const PathVertex& v : stage)
+        counts[direction_octant(v.ray.direction) + 1]++;
+    for (int i = 1; i < 9; i++)
+        counts[i] += counts[i - 1];
+
+    order.resize(stage.size());
+    for (size_t i = 0; i < stage.size(); i++)
+        order[counts[direction_octant(stage[i].ray.direction)]++] = i;
+}
+
+// Orders the shadow queries by light, keeping the vertex order within each light
+static void bin_by_light(const vector<ShadowQuery>& queries, int num_lights, vector<int>& order)
+{
+    vector<int> counts(num_lights + 1, 0);
+    for (const ShadowQuery& q : queries)
+        counts[q.light + 1]++;
+    for (int i = 1; i <= num_lights; i++)
+        counts[i] += counts[i - 1];
+
+    order.resize(queries.size());
+    for (size_t i = 0; i < queries.size(); i++)
+        order[counts[queries[i].light]++] = i;
+}
+
+/* Renders a tile with an iterative pipeline instead of the recursive tracer.
+The rays of one recursion depth form a stage that goes through three batches:
+closest hits for all rays, shadow rays for all hits binned by light, and the
+reflection rays that make up the next stage. The colors are then accumulated in
+the same order as shade() does, so both renderers produce the same image. */
+void Scene::renderTileWavefront(const Camera* cam, const ImageView& image, int row_begin, int row_end, int col_begin, int col_end)
+{
+    int width = col_end - col_begin;
+    int num_lights = lights.size();
+
+    vector<vector<PathVertex>> stages(maxRecursionDepth + 1);
+    vector<vector<unsigned char>> visible(maxRecursionDepth + 1);
+    vector<int> order;
+    vector<ShadowQuery> shadow_queue;
+    vector<int> shadow_order;
+    vector<int> light_list;
+
+    stages[0].reserve((row_end - row_begin) * width);
+    vector<Ray> row_rays(width);
+    for (int i = row_begin; i < row_end; i++)
+    {
+        cam->getPrimaryRays(i, col_begin, width, row_rays.data());
+        for (int j = col_begin; j < col_end; j++)
+        {
+            PathVertex v;
+            v.ray = row_rays[j - col_begin];
+            v.parent = (i - row_begin) * width + (j - col_begin);
+            v.child = -1;
+            stages[0].push_back(v);
+        }
+    }
+    rayCounters.primaryRays += stages[0].size();
+
+    int num_stages = 0;
+    for (int depth = 0; depth <= maxRecursionDepth && !stages[depth].empty(); depth++)
+    {
+        vector<PathVertex>& stage = stages[depth];
+        num_stages = depth + 1;
+
+        // closest hits, in packets of rays with the same direction octant when packet tracing is on
+        bin_by_direction(stage, order);
+        int num_rays = order.size();
+        if (packetTracing)
+        {
+            Ray rays[PACKET_SIZE];
+            ReturnVal results[PACKET_SIZE];
+            for (int first = 0; first < num_rays; first += PACKET_SIZE)
+            {
+                for (int lane = 0; lane < PACKET_SIZE; lane++)
+                    rays[lane] = stage[order[std::min(first + lane, num_rays - 1)]].ray;
+
+                RayPacket packet(rays);
+                intersectPacket(packet, rays, results);
+
+                for (int lane = 0; lane < PACKET_SIZE && first + lane < num_rays; lane++)
+                    stage[order[first + lane]].hit = results[lane];
+            }
+        }
+        else
+        {
+            for (int index : order)
+                stage[index].hit = intersect(stage[index].ray);
+        }
+
+        // shadow rays towards the lights that can reach each hit, traced in one batch per light
+        visible[depth].assign(stage.size() * num_lights, 0);
+        shadow_queue.clear();
+        for (int index : order)
+        {
+            // materials without diffuse, specular or mirror terms ignore the lights
+            if (!stage[index].hit.intersects || materialFeatures[stage[index].hit.material_index - 1] == 0)
+                continue;
+            gatherLights(stage[index].hit, light_list);
+            for (int l : light_list)
+            {
+                ShadowQuery query;
+                Vector3f light_dir_normalized;
+                query.ray = shadowRay(stage[index].hit, lights[l], light_dir_normalized, query.tmax);
+                query.vertex = index;
+                query.light = l;
+                shadow_queue.push_back(query);
+            }
+        }
+
+        rayCounters.shadowRays += shadow_queue.size();
+        bin_by_light(shadow_queue, num_lights, shadow_order);
+        for (int q : shadow_order)
+        {
+            const ShadowQuery& query = shadow_queue[q];
+            if (!occluded(query.ray, query.tmax))
+                visible[depth][query.vertex * num_lights + query.light] = 1;
+        }
+
+        // reflection rays of the mirror hits that receive light form the next stage
+        int recDepth = maxRecursionDepth - depth;
+        if (recDepth == 0)
+            continue;
+        for (int index : order)
+        {
+            PathVertex& v = stage[index];
+            if (!v.hit.intersects || !(materialFeatures[v.hit.material_index - 1] & MATERIAL_MIRROR))
+                continue;
+
+            bool lit = false;
+            for (int l = 0; l < num_lights && !lit; l++)
+                lit = visible[depth][index * num_lights + l] != 0;
+            if (!lit)
+                continue;
+
+            PathVertex reflection;
+            reflection.ray = reflectionRay(v.ray, v.hit);
+            reflection.parent = index;
+            reflection.child = -1;
+            v.child = stages[depth + 1].size();
+            stages[depth + 1].push_back(reflection);
+        }
+        rayCounters.reflectionRays += stages[depth + 1].size();
+    }
+
+    // resolve the colors from the deepest stage up, adding the terms in the order shade() uses
+    for (int depth = num_stages - 1; depth >= 0; depth--)
+    {
+        vector<PathVertex>& stage = stages[depth];
+        for (size_t index = 0; index < stage.size(); index++)
+        {
+            PathVertex& v = stage[index];
+            if (!v.hit.intersects)
+            {
+                v.color = backgroundColor;
+                continue;
+            }
+
+            const Material& mat = *(materials[v.hit.material_index - 1]);
+            Vector3f color(0, 0, 0);
+            color = color + ambientLight.pointwise_multiplication(mat.ambientRef);
+
+            for (int l = 0; l < num_lights; l++)
+            {
+                if (!visible[depth][index * num_lights + l])
+                    continue;
+
+                Vector3f light_dir_normalized;
+                float light_tmax;
+                shadowRay(v.hit, lights[l], light_dir_normalized, light_tmax);
+                addLightContribution(color, v.ray, v.hit, mat, lights[l], light_dir_normalized);
+
+                if (v.child != -1)
+                    color = color + stages[depth + 1][v.child].color.pointwise_multiplication(mat.mirrorRef);
+            }
+            v.color = color;
+        }
+    }
+
+    for (const PathVertex& v : stages[0])
+    {
+        int row = row_begin + v.parent / width;
+        int col = col_begin + v.parent % width;
+        Color result = {(unsigned char) std::round(std::min(v.color.x, 255.0f)), (unsigned char) std::round(std::min(v.color.y, 255.0f)), (unsigned char) std::round(std::min(v.color.z, 255.0f))};
+        image.at(col, row) = result;
+    }
+}
@@ -0,0 +1,228 @@
+#include "WorkerPool.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <deque>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_RESULT_SIZE (1u << 30)	// Larger replies are taken as a broken worker
+
+// Reply of a worker, followed by size bytes of result
+typedef struct ReplyHeader
+{
+    int task;
+    unsigned int size;
+} ReplyHeader;
+
+// Loops over short transfers, false on an error or when the other end is gone
+static bool send_all(int fd, const void *data, size_t size)
+{
+    const char *bytes = (const char *) data;
+    while (size > 0)
+    {
+        ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void *data, size_t size)
+{
+    char *bytes = (char *) data;
+    while (size > 0)
+    {
+        ssize_t n = recv(fd, bytes, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Output buffered in the caller is flushed before every fork, otherwise the
+workers would inherit it and write it a second time. */
+WorkerPool::WorkerPool(int numWorkers, const function<void(int, vector<unsigned char>&)>& job)
+    : job(job)
+{
+    for (int i = 0; i < numWorkers; i++)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            perror("socketpair");
+            break;
+        }
+
+        fflush(nullptr);
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            close(fds[0]);
+            close(fds[1]);
+            break;
+        }
+
+        if (pid == 0)
+        {
+            // the sockets of the earlier workers must be closed here, or they would not see their end of file
+            close(fds[0]);
+            for (const Worker& worker : workers)
+                close(worker.fd);
+            serve(fds[1]);
+        }
+
+        close(fds[1]);
+        Worker worker = {pid, fds[0], -1};
+        workers.push_back(worker);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    for (Worker& worker : workers)
+    {
+        if (worker.fd == -1)
+            continue;
+        close(worker.fd);
+        waitpid(worker.pid, nullptr, 0);
+    }
+}
+
+int WorkerPool::size() const
+{
+    return workers.size();
+}
+
+void WorkerPool::serve(int fd)
+{
+    vector<unsigned char> result;
+    int task;
+    while (recv_all(fd, &task, sizeof(task)))
+    {
+        result.clear();
+        job(task, result);
+
+        ReplyHeader header = {task, (unsigned int) result.size()};
+        if (!send_all(fd, &header, sizeof(header)) || !send_all(fd, result.data(), result.size()))
+            break;
+    }
+    _exit(0);
+}
+
+// Stops a worker that died or misbehaved, it gets no more tasks
+void WorkerPool::fail(Worker& worker)
+{
+    close(worker.fd);
+    kill(worker.pid, SIGKILL);
+    waitpid(worker.pid, nullptr, 0);
+    worker.fd = -1;
+    worker.task = -1;
+}
+
+/* Every worker has at most one task in flight, so a slow worker holds back a
+single task and a failed one loses only that task, which is queued again. */
+void WorkerPool::run(int numTasks, const function<bool(int, int, const vector<unsigned char>&)>& collect)
+{
+    deque<int> pending;
+    for (int task = 0; task < numTasks; task++)
+        pending.push_back(task);
+
+    int done = 0;
+    vector<unsigned char> result;
+    vector<pollfd> polled;
+    vector<int> polledWorkers;
+
+    while (done < numTasks)
+    {
+        for (Worker& worker : workers)
+        {
+            if (worker.fd == -1 || worker.task != -1 || pending.empty())
+                continue;
+            worker.task = pending.front();
+            pending.pop_front();
+            if (!send_all(worker.fd, &worker.task, sizeof(worker.task)))
+            {
+                fprintf(stderr, "worker %d failed, its task is reassigned\n", (int) worker.pid);
+                pending.push_front(worker.task);
+                fail(worker);
+            }
+        }
+
+        polled.clear();
+        polledWorkers.clear();
+        for (int w = 0; w < (int) workers.size(); w++)
+        {
+            if (workers[w].task == -1)
+                continue;
+            pollfd entry = {workers[w].fd, POLLIN, 0};
+            polled.push_back(entry);
+            polledWorkers.push_back(w);
+        }
+
+        // no worker is left, the caller finishes the remaining tasks itself
+        if (polled.empty())
+        {
+            while (!pending.empty())
+            {
+                int task = pending.front();
+                pending.pop_front();
+                result.clear();
+                job(task, result);
+                collect(task, workers.size(), result);
+                done++;
+            }
+            break;
+        }
+
+        if (poll(polled.data(), polled.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            for (int w : polledWorkers)
+            {
+                pending.push_front(workers[w].task);
+                fail(workers[w]);
+            }
+            continue;
+        }
+
+        for (size_t i = 0; i < polled.size(); i++)
+        {
+            if (polled[i].revents == 0)
+                continue;
+
+            Worker& worker = workers[polledWorkers[i]];
+            ReplyHeader header;
+            bool valid = recv_all(worker.fd, &header, sizeof(header)) && header.task == worker.task && header.size <= MAX_RESULT_SIZE;
+            if (valid)
+            {
+                result.resize(header.size);
+                valid = recv_all(worker.fd, result.data(), result.size()) && collect(worker.task, polledWorkers[i], result);
+            }
+
+            if (!valid)
+            {
+                fprintf(stderr, "worker %d failed, its task is reassigned\n", (int) worker.pid);
+                pending.push_front(worker.task);
+                fail(worker);
+                continue;
+            }
+            worker.task = -1;
+            done++;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef _WORKERPOOL_H_
+#define _WORKERPOOL_H_
+
+#include <functional>
+#include <vector>
+#include <sys/types.h>
+
+using namespace std;
+
+// Pool of worker processes forked from the caller. Each worker is connected to the
+// caller through a Unix domain socket pair and inherits the loaded scene, so it
+// only receives task numbers and sends back the bytes the job produced for them.
+class WorkerPool
+{
+public:
+	// Forks numWorkers workers that run job(task, result) for every task they receive
+	WorkerPool(int numWorkers, const function<void(int, vector<unsigned char>&)>& job);
+	~WorkerPool();	// Closes the sockets and waits for the workers to exit
+
+	int size() const;	// Number of workers started, including the ones that failed since
+
+	// Runs every task in [0, numTasks) on the workers and calls collect(task, worker, result)
+	// for each result as it arrives; collect returns false for a result it cannot use. The
+	// task of a worker that dies or sends a broken reply goes to another worker. Once no
+	// worker is left the caller runs the remaining tasks itself, as worker size().
+	void run(int numTasks, const function<bool(int, int, const vector<unsigned char>&)>& collect);
+
+private:
+	typedef struct Worker
+	{
+		pid_t pid;
+		int fd;		// Caller end of the socket pair, -1 once the worker failed
+		int task;	// Task in flight, -1 when idle
+	} Worker;
+
+	vector<Worker> workers;
+	function<void(int, vector<unsigned char>&)> job;
+
+	void serve(int fd);	// Request loop of a worker process, never returns
+	void fail(Worker& worker);
+};
+
+#endif
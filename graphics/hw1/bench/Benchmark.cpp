@@ -0,0 +1,250 @@
+#include "../defs.h"
+#include "../Scene.h"
+#include "../Camera.h"
+#include "../Light.h"
+#include <cstdint>
+#include <random>
+
+Scene *pScene; // definition of the global scene variable (declared in defs.h)
+
+#define BENCH_SEED 477			// Seed of the ray sets, fixed so runs and builds can be compared
+#define BENCH_RAYS 8192			// Rays per set
+#define BENCH_MIN_SECONDS 0.1	// A measurement repeats passes over its set for at least this long
+#define BENCH_REPEATS 5			// Measurements per kernel, the fastest one is reported
+
+static const char *defaultScenes[] = {
+	"hw1_sample_scenes/bunny.xml",
+	"hw1_sample_scenes/dragon_lowres.xml",
+	"hw1_sample_scenes/cornellbox.xml",
+};
+
+typedef struct BenchResult
+{
+	string scene;
+	string kernel;
+	double nsPerRay;
+} BenchResult;
+
+/* Times the tracing kernels of a scene on one thread:
+	closest-hit	Scene::intersect on primary rays through random points of the first camera
+	any-hit		Scene::occluded on shadow rays from the hits of those rays to a random light
+	shading		Scene::shade on the hits, with the reflections and shadow rays it traces
+The ray sets only depend on the scene and BENCH_SEED. */
+class Benchmark
+{
+public:
+	static void run(Scene& scene, const string& name, vector<BenchResult>& results);
+
+private:
+	// Fastest of BENCH_REPEATS measurements of pass(), which handles numRays rays
+	template <typename F>
+	static double measure(int numRays, F pass);
+};
+
+template <typename F>
+double Benchmark::measure(int numRays, F pass)
+{
+	double best = numeric_limits<double>::infinity();
+	for (int r = 0; r < BENCH_REPEATS; r++)
+	{
+		long long rays = 0;
+		double start = currentSeconds();
+		double elapsed;
+		do
+		{
+			pass();
+			rays += numRays;
+			elapsed = currentSeconds() - start;
+		} while (elapsed < BENCH_MIN_SECONDS);
+		best = std::min(best, elapsed * 1e9 / rays);
+	}
+	return best;
+}
+
+// The raw output of mt19937 is fixed by the standard, unlike the distributions
+static float uniform(mt19937& rng)
+{
+	return rng() / 4294967296.0;
+}
+
+void Benchmark::run(Scene& scene, const string& name, vector<BenchResult>& results)
+{
+	const Camera* cam = scene.cameras[0];
+	mt19937 rng(BENCH_SEED);
+	scene.buildLightBVH();
+
+	vector<Ray> rays(BENCH_RAYS);
+	for (Ray& ray : rays)
+		ray = cam->getRay(uniform(rng) * cam->imgPlane.nx, uniform(rng) * cam->imgPlane.ny);
+
+	vector<Ray> hit_rays;
+	vector<ReturnVal> hits;
+	vector<Ray> shadow_rays;
+	vector<float> shadow_tmax;
+	for (const Ray& ray : rays)
+	{
+		ReturnVal hit = scene.intersect(ray);
+		if (!hit.intersects)
+			continue;
+		hit_rays.push_back(ray);
+		hits.push_back(hit);
+		if (scene.lights.empty())
+			continue;
+		Vector3f light_dir;
+		float tmax;
+		PointLight* light = scene.lights[rng() % scene.lights.size()];
+		shadow_rays.push_back(scene.shadowRay(hit, light, light_dir, tmax));
+		shadow_tmax.push_back(tmax);
+	}
+
+	// the results are summed so the calls cannot be left out
+	volatile float sink = 0;
+
+	results.push_back({name, "closest-hit", measure(rays.size(), [&]() {
+		float sum = 0;
+		for (const Ray& ray : rays)
+			sum += scene.intersect(ray).t;
+		sink = sink + sum;
+	})});
+
+	if (!shadow_rays.empty())
+	{
+		results.push_back({name, "any-hit", measure(shadow_rays.size(), [&]() {
+			int count = 0;
+			for (size_t i = 0; i < shadow_rays.size(); i++)
+				count += scene.occluded(shadow_rays[i], shadow_tmax[i]);
+			sink = sink + count;
+		})});
+	}
+
+	if (!hits.empty())
+	{
+		results.push_back({name, "shading", measure(hits.size(), [&]() {
+			float sum = 0;
+			for (size_t i = 0; i < hits.size(); i++)
+				sum += scene.shade(hit_rays[i], hits[i], scene.maxRecursionDepth).x;
+			sink = sink + sum;
+		})});
+	}
+}
+
+// Name of a scene in the results, the file name without the extension
+static string scene_name(const char *path)
+{
+	string name = path;
+	size_t slash = name.rfind('/');
+	if (slash != string::npos)
+		name = name.substr(slash + 1);
+	size_t dot = name.rfind('.');
+	return (dot == string::npos) ? name : name.substr(0, dot);
+}
+
+// Results are stored one per line as "scene kernel ns"
+static bool save_results(const char *path, const vector<BenchResult>& results)
+{
+	FILE *file = fopen(path, "w");
+	if (file == nullptr)
+	{
+		fprintf(stderr, "could not write %s\n", path);
+		return false;
+	}
+	for (const BenchResult& r : results)
+		fprintf(file, "%s %s %.3f\n", r.scene.c_str(), r.kernel.c_str(), r.nsPerRay);
+	return fclose(file) == 0;
+}
+
+static bool load_results(const char *path, vector<BenchResult>& results)
+{
+	FILE *file = fopen(path, "r");
+	if (file == nullptr)
+	{
+		fprintf(stderr, "could not read %s\n", path);
+		return false;
+	}
+	char scene[256], kernel[64];
+	double ns;
+	while (fscanf(file, "%255s %63s %lf", scene, kernel, &ns) == 3)
+		results.push_back({scene, kernel, ns});
+	fclose(file);
+	return true;
+}
+
+static void printUsage(const char *program)
+{
+	fprintf(stderr, "usage: %s [--save FILE] [--compare FILE] [--threshold PERCENT] [scene.xml ...]\n", program);
+}
+
+/* Without scene arguments the sample scenes are used, so run it from graphics/hw1.
+With --compare every kernel is printed next to its time in the given results and
+the ones slower by more than the threshold (5% by default) are flagged, the exit
+status is then 2 if there was any. */
+int main(int argc, char *argv[])
+{
+	const char *savePath = nullptr;
+	const char *comparePath = nullptr;
+	double threshold = 5;
+	vector<const char *> scenes;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+			savePath = argv[++i];
+		else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc)
+			comparePath = argv[++i];
+		else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+			threshold = atof(argv[++i]);
+		else if (argv[i][0] != '-')
+			scenes.push_back(argv[i]);
+		else
+		{
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+	if (scenes.empty())
+		scenes.assign(defaultScenes, defaultScenes + sizeof(defaultScenes) / sizeof(defaultScenes[0]));
+
+	vector<BenchResult> baseline;
+	if (comparePath != nullptr && !load_results(comparePath, baseline))
+		return 1;
+
+	vector<BenchResult> results;
+	for (const char *path : scenes)
+	{
+		Scene *scene = new Scene(path);
+		if (scene->cameras.empty())
+		{
+			fprintf(stderr, "%s has no camera to shoot the rays from\n", path);
+			return 1;
+		}
+		Benchmark::run(*scene, scene_name(path), results);
+	}
+
+	int regressions = 0;
+	for (const BenchResult& r : results)
+	{
+		printf("%-16s %-12s %10.1f ns/ray", r.scene.c_str(), r.kernel.c_str(), r.nsPerRay);
+		for (const BenchResult& b : baseline)
+		{
+			if (b.scene != r.scene || b.kernel != r.kernel)
+				continue;
+			double change = (r.nsPerRay / b.nsPerRay - 1) * 100;
+			printf("  was %10.1f  %+6.1f%%", b.nsPerRay, change);
+			if (change > threshold)
+			{
+				printf("  REGRESSION");
+				regressions++;
+			}
+		}
+		printf("\n");
+	}
+
+	if (savePath != nullptr && !save_results(savePath, results))
+		return 1;
+	if (regressions > 0)
+	{
+		printf("%d kernel(s) slower than %s by more than %.1f%%\n", regressions, comparePath, threshold);
+		return 2;
+	}
+	return 0;
+}
@@ -4,6 +4,7 @@
 #include <cmath> 
 #include <stdexcept>
 #include <limits>
+#include <type_traits>
 
 class Scene;
 
@@ -36,32 +37,11 @@ typedef struct Vector3f
 	float y;
 	float z;
 
-	// default constructor
-	Vector3f() {}
+	// default constructor, leaves the components uninitialized. Vector3f has no
+	// user defined copy operations, so it stays trivially copyable
+	Vector3f() = default;
 	// constructor
-	Vector3f(float x, float y, float z)
-	{
-		this->x = x;
-		this->y = y;
-		this->z = z;
-	}
-
-	// copy constructor
-	Vector3f(const Vector3f& right)
-	{
-		this->x = right.x;
-		this->y = right.y;
-		this->z = right.z;
-	}
-
-	// overloaded assignment operator
-	Vector3f& operator=(const Vector3f& right)
-	{
-		this->x = right.x;
-		this->y = right.y;
-		this->z = right.z;
-		return *this;
-	}
+	constexpr Vector3f(float x, float y, float z) : x(x), y(y), z(z) {}
 
 	float length() const
 	{
@@ -76,74 +56,246 @@ typedef struct Vector3f
 		return result;
 	}
 
-	bool operator==(const Vector3f right) const
+	constexpr bool operator==(const Vector3f& right) const
 	{
-		if (x == right.x &&
-			y == right.y &&
-			z == right.z)
-			return true;
-		return false;
+		return x == right.x && y == right.y && z == right.z;
 	}
 
-	Vector3f operator+(const Vector3f right) const
+	constexpr Vector3f operator+(const Vector3f& right) const
 	{
-		Vector3f result(x + right.x, y + right.y, z + right.z);
-		return result;
+		return Vector3f(x + right.x, y + right.y, z + right.z);
 	}
 
-	Vector3f operator-(const Vector3f right) const
+	constexpr Vector3f operator-(const Vector3f& right) const
 	{
-		Vector3f result(x - right.x, y - right.y, z - right.z);
-		return result;
+		return Vector3f(x - right.x, y - right.y, z - right.z);
 	}
 
 	// dot product
-	float operator*(const Vector3f right) const
+	constexpr float operator*(const Vector3f& right) const
 	{
-		float result = x * right.x + y * right.y + z * right.z;
-		return result;
+		return x * right.x + y * right.y + z * right.z;
 	}
 
 	// scalar multiplication
-	Vector3f operator*(float k) const
+	constexpr Vector3f operator*(float k) const
 	{
-		Vector3f result(k*x, k*y, k*z);
-		return result;
+		return Vector3f(k*x, k*y, k*z);
 	}
 
 	// scalar division
-	Vector3f operator/(float k) const
+	constexpr Vector3f operator/(float k) const
 	{
-		Vector3f result(x/k, y/k, z/k);
-		return result;
+		return Vector3f(x/k, y/k, z/k);
 	}
 
-	Vector3f cross_product(const Vector3f right) const
+	constexpr Vector3f cross_product(const Vector3f& right) const
 	{
-		Vector3f result(y * right.z - z * right.y, 
-						z * right.x - x * right.z, 
+		return Vector3f(y * right.z - z * right.y,
+						z * right.x - x * right.z,
 						x * right.y - y * right.x);
+	}
+
+	constexpr Vector3f pointwise_multiplication(const Vector3f& right) const
+	{
+		return Vector3f(x * right.x, y * right.y, z * right.z);
+	}
+
+	constexpr Vector3f pointwise_division(const Vector3f& right) const
+	{
+		return Vector3f(x / right.x, y / right.y, z / right.z);
+	}
+
+	constexpr bool is_zero() const
+	{
+		return (x == 0 && y == 0 && z == 0);
+	}
+
+} Vector3f;
+
+static_assert(std::is_trivially_copyable<Vector3f>::value, "Vector3f is copied with memcpy by the scene cache");
+
+constexpr float dot(const Vector3f& a, const Vector3f& b)
+{
+	return a * b;
+}
+
+constexpr Vector3f cross(const Vector3f& a, const Vector3f& b)
+{
+	return a.cross_product(b);
+}
+
+/* a * b + c, component wise. The product is rounded before the sum like in the
+rest of the tracer; a fused multiply add would round once and change the images. */
+constexpr Vector3f madd(const Vector3f& a, const Vector3f& b, const Vector3f& c)
+{
+	return Vector3f(a.x * b.x + c.x, a.y * b.y + c.y, a.z * b.z + c.z);
+}
+
+// a * k + c
+constexpr Vector3f madd(const Vector3f& a, float k, const Vector3f& c)
+{
+	return Vector3f(a.x * k + c.x, a.y * k + c.y, a.z * k + c.z);
+}
+
+// component wise 1 / v, an infinity for a zero component like the inverse directions of the box tests
+constexpr Vector3f reciprocal(const Vector3f& v)
+{
+	return Vector3f(1.0f / v.x, 1.0f / v.y, 1.0f / v.z);
+}
+
+/* 4 component vector aligned to 16 bytes, so one fits an SSE register and
+arrays of them can be loaded without shuffles. Used for points with w = 1,
+directions with w = 0. */
+typedef struct alignas(16) Vector4f
+{
+	float x;
+	float y;
+	float z;
+	float w;
+
+	Vector4f() = default;
+	constexpr Vector4f(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
+	constexpr Vector4f(const Vector3f& v, float w) : x(v.x), y(v.y), z(v.z), w(w) {}
+
+	constexpr Vector3f xyz() const
+	{
+		return Vector3f(x, y, z);
+	}
+
+	constexpr Vector4f operator+(const Vector4f& right) const
+	{
+		return Vector4f(x + right.x, y + right.y, z + right.z, w + right.w);
+	}
+
+	constexpr Vector4f operator-(const Vector4f& right) const
+	{
+		return Vector4f(x - right.x, y - right.y, z - right.z, w - right.w);
+	}
+
+	constexpr Vector4f operator*(float k) const
+	{
+		return Vector4f(k*x, k*y, k*z, k*w);
+	}
+
+	// dot product of all four components
+	constexpr float operator*(const Vector4f& right) const
+	{
+		return x * right.x + y * right.y + z * right.z + w * right.w;
+	}
+
+} Vector4f;
+
+static_assert(std::is_trivially_copyable<Vector4f>::value && sizeof(Vector4f) == 16, "Vector4f must fit an SSE register");
+
+/* Affine transformation, stored as the first three rows of a 4x4 matrix
+whose last row is 0 0 0 1. */
+typedef struct Transform
+{
+	float m[3][4];
+
+	// identity
+	Transform()
+	{
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 4; j++)
+				m[i][j] = (i == j) ? 1 : 0;
+	}
+
+	static Transform translation(const Vector3f& t)
+	{
+		Transform result;
+		result.m[0][3] = t.x;
+		result.m[1][3] = t.y;
+		result.m[2][3] = t.z;
 		return result;
 	}
 
-	Vector3f pointwise_multiplication(const Vector3f right) const
+	static Transform scaling(const Vector3f& s)
 	{
-		Vector3f result(x * right.x, y * right.y, z * right.z);
+		Transform result;
+		result.m[0][0] = s.x;
+		result.m[1][1] = s.y;
+		result.m[2][2] = s.z;
 		return result;
 	}
 
-	Vector3f pointwise_division(const Vector3f right) const
+	// rotation by the given angle in degrees around an axis through the origin
+	static Transform rotation(float degrees, const Vector3f& axis)
 	{
-		Vector3f result(x / right.x, y / right.y, z / right.z);
+		Vector3f a = axis.normalize();
+		float rad = degrees * 3.14159265f / 180;
+		float c = cos(rad), s = sin(rad), t = 1 - c;
+		Transform result;
+		result.m[0][0] = t * a.x * a.x + c;       result.m[0][1] = t * a.x * a.y - s * a.z; result.m[0][2] = t * a.x * a.z + s * a.y;
+		result.m[1][0] = t * a.x * a.y + s * a.z; result.m[1][1] = t * a.y * a.y + c;       result.m[1][2] = t * a.y * a.z - s * a.x;
+		result.m[2][0] = t * a.x * a.z - s * a.y; result.m[2][1] = t * a.y * a.z + s * a.x; result.m[2][2] = t * a.z * a.z + c;
 		return result;
 	}
 
-	bool is_zero()
+	// composition, right is applied first
+	Transform operator*(const Transform& right) const
 	{
-		return (x == 0 && y == 0 && z == 0);
+		Transform result;
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				result.m[i][j] = m[i][0] * right.m[0][j] + m[i][1] * right.m[1][j] + m[i][2] * right.m[2][j] + ((j == 3) ? m[i][3] : 0);
+			}
+		}
+		return result;
 	}
 
-} Vector3f;
+	Vector3f point(const Vector3f& p) const
+	{
+		return Vector3f(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+						m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+						m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+	}
+
+	Vector3f vector(const Vector3f& v) const
+	{
+		return Vector3f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+						m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+						m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+	}
+
+	// transpose of the linear part applied to v, maps normals when called on the inverse transform
+	Vector3f transposedVector(const Vector3f& v) const
+	{
+		return Vector3f(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+						m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+						m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+	}
+
+	// inverse through the adjugate of the linear part, the transform must not be singular
+	Transform inverse() const
+	{
+		float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+					m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+					m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+		float inv = 1 / det;
+
+		Transform result;
+		result.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv;
+		result.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv;
+		result.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv;
+		result.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv;
+		result.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv;
+		result.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv;
+		result.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv;
+		result.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv;
+		result.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv;
+
+		Vector3f t = result.vector(Vector3f(m[0][3], m[1][3], m[2][3]));
+		result.m[0][3] = -t.x;
+		result.m[1][3] = -t.y;
+		result.m[2][3] = -t.z;
+		return result;
+	}
+
+} Transform;
 
 /* Structure to hold return value from ray intersection routine. 
 This should hold information related to the intersection point, 
@@ -170,6 +322,27 @@ typedef struct ReturnVal
 } ReturnVal;
 
 
+// Shape types, each type is stored in its own array in Scene
+enum ObjectType
+{
+	OBJECT_SPHERE = 1,
+	OBJECT_TRIANGLE = 2,
+	OBJECT_MESH = 3,
+	OBJECT_INSTANCE = 4
+};
+
+/* Result of the closest hit search. It only identifies the hit, the surface
+attributes in ReturnVal are computed once for the final hit by Shape::hitAttributes. */
+typedef struct HitRecord
+{
+	float t;		// Ray parameter of the hit
+	int objectType;		// ObjectType of the hit object
+	int object;		// Index of the hit object in the array of its type, -1 if nothing was hit
+	int prim;		// Face index inside a mesh or the mesh of an instance
+	float beta, gamma;	// Barycentric coordinates for triangles
+
+} HitRecord;
+
 //
 // The global variable through which you can access the scene data
 //
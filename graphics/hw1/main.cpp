@@ -2,16 +2,161 @@
 #include "Scene.h"
 #include "Camera.h"
 #include "Shape.h"
+#include "Animation.h"
+#include <thread>
+#include <csignal>
 
 Scene *pScene; // definition of the global scene variable (declared in defs.h)
 
+static void cancelRender(int)
+{
+	pScene->cancelled = true;
+	signal(SIGINT, SIG_DFL);
+}
+
+static void printUsage(const char *program)
+{
+	fprintf(stderr, "usage: %s <scene.xml> [--threads N] [--workers N] [--packets] [--wavefront] [--aa SAMPLES] [--aa-threshold T] [--light-cutoff C] [--progressive] [--cameras ID,ID,...] [--gbuffer] [--relight] [--format p3|p6|png] [--animation FILE] [--no-cache] [--out-of-core MB] [--stats] [--stats-json FILE]\n", program);
+}
+
 int main(int argc, char *argv[])
 {
-	const char *xmlPath = argv[1];
+	const char *xmlPath = nullptr;
+	int numThreads = std::thread::hardware_concurrency();
+	int numWorkers = 0;
+	bool packetTracing = false;
+	bool wavefront = false;
+	int aaMaxSamples = 1;
+	bool progressive = false;
+	vector<int> cameraIds;
+	bool saveGBuffer = false;
+	bool relight = false;
+	float aaThreshold = 8;
+	float lightCutoff = 0;
+	bool useCache = true;
+	double outOfCoreMB = 0;
+	bool printStats = false;
+	const char *statsPath = nullptr;
+	const char *animationPath = nullptr;
+	ImageFormat imageFormat = IMAGE_FORMAT_AUTO;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			numThreads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+			numWorkers = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--packets") == 0)
+			packetTracing = true;
+		else if (strcmp(argv[i], "--wavefront") == 0)
+			wavefront = true;
+		else if (strcmp(argv[i], "--cameras") == 0 && i + 1 < argc)
+		{
+			// comma separated list of camera ids
+			for (char *id = strtok(argv[++i], ","); id != nullptr; id = strtok(nullptr, ","))
+				cameraIds.push_back(atoi(id));
+		}
+		else if (strcmp(argv[i], "--gbuffer") == 0)
+			saveGBuffer = true;
+		else if (strcmp(argv[i], "--relight") == 0)
+			relight = true;
+		else if (strcmp(argv[i], "--progressive") == 0)
+			progressive = true;
+		else if (strcmp(argv[i], "--aa") == 0 && i + 1 < argc)
+			aaMaxSamples = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--aa-threshold") == 0 && i + 1 < argc)
+			aaThreshold = atof(argv[++i]);
+		else if (strcmp(argv[i], "--light-cutoff") == 0 && i + 1 < argc)
+			lightCutoff = atof(argv[++i]);
+		else if (strcmp(argv[i], "--stats") == 0)
+			printStats = true;
+		else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc)
+			statsPath = argv[++i];
+		else if (strcmp(argv[i], "--animation") == 0 && i + 1 < argc)
+			animationPath = argv[++i];
+		else if (strcmp(argv[i], "--no-cache") == 0)
+			useCache = false;
+		else if (strcmp(argv[i], "--out-of-core") == 0 && i + 1 < argc)
+			outOfCoreMB = atof(argv[++i]);
+		else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "p3") == 0)
+				imageFormat = IMAGE_FORMAT_P3;
+			else if (strcmp(argv[i], "p6") == 0)
+				imageFormat = IMAGE_FORMAT_P6;
+			else if (strcmp(argv[i], "png") == 0)
+				imageFormat = IMAGE_FORMAT_PNG;
+			else
+			{
+				printUsage(argv[0]);
+				return 1;
+			}
+		}
+		else if (argv[i][0] != '-' && xmlPath == nullptr)
+			xmlPath = argv[i];
+		else
+		{
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (xmlPath == nullptr)
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+    // out of core the mesh faces are paged from the scene cache, so it is always used
+    if (outOfCoreMB > 0 && !useCache)
+        fprintf(stderr, "--out-of-core pages the meshes from the scene cache, --no-cache is ignored\n");
+    size_t outOfCoreBudget = (outOfCoreMB > 0) ? (size_t) (outOfCoreMB * 1024 * 1024) : 0;
+    pScene = new Scene(xmlPath, (numThreads > 0) ? numThreads : 1, useCache || outOfCoreBudget > 0, outOfCoreBudget);
+    pScene->numWorkers = (numWorkers > 0) ? numWorkers : 0;
+    pScene->packetTracing = packetTracing;
+    pScene->wavefront = wavefront;
+    pScene->aaMaxSamples = (aaMaxSamples > 1) ? aaMaxSamples : 1;
+    pScene->aaThreshold = aaThreshold;
+    pScene->progressive = progressive;
+    pScene->cameraIds = cameraIds;
+    pScene->saveGBuffer = saveGBuffer;
+    pScene->relight = relight;
+    pScene->lightCutoff = lightCutoff;
+    pScene->imageFormat = imageFormat;
+
+    // the first interrupt stops a progressive render after its last finished pass,
+    // a second one terminates as usual
+    if (progressive)
+        signal(SIGINT, cancelRender);
+
+    // an explicit format also decides the extension of the images
+    for (Camera* cam : pScene->cameras)
+    {
+        string given = cam->imageName;
+        if (Image::matchExtension(cam->imageName, sizeof(cam->imageName), imageFormat))
+            fprintf(stderr, "writing %s instead of %s to match --format\n", cam->imageName, given.c_str());
+    }
 
-    pScene = new Scene(xmlPath);
+    // the frames of an animation reuse the parsed scene, each frame only moves what changed
+    if (animationPath != nullptr)
+    {
+        Animation animation;
+        if (!animation.load(animationPath, *pScene))
+            return 1;
+        for (int frame = 0; frame < animation.numFrames() && !pScene->cancelled; frame++)
+        {
+            animation.apply(*pScene, frame);
+            pScene->renderScene();
+        }
+    }
+    else
+        pScene->renderScene();
 
-    pScene->renderScene();
+    if (printStats)
+        pScene->stats.printTable(stdout);
+    if (statsPath != nullptr && !pScene->stats.writeJSON(statsPath))
+        fprintf(stderr, "could not write %s\n", statsPath);
 
 	return 0;
 }